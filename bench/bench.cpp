@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdlib.h>
+
+#include <atomic>
+
+#include "bench.hpp"
+
+static std::atomic<uint64_t> g_allocs{0};
+
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void *ptr, size_t size);
+
+// Every heap allocation of the process goes through these, json-c and
+// operator new included.
+void* malloc (size_t size) noexcept
+{
+  g_allocs++;
+  return __libc_malloc(size);
+}
+
+void* calloc (size_t count, size_t size) noexcept
+{
+  g_allocs++;
+  return __libc_calloc(count, size);
+}
+
+void* realloc (void *ptr, size_t size) noexcept
+{
+  g_allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+}
+
+uint64_t bench_allocs (void)
+{
+  return g_allocs.load();
+}
+
+void bench_report (const char *name, int n, const BenchResult& result)
+{
+  printf("%-32s %8d ops %8llu ns/op %6llu allocs\n", name, n,
+         (unsigned long long)result.ns_per_op,
+         (unsigned long long)result.allocs);
+}
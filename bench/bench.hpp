@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "reactor.hpp"
+
+/*
+ * Micro benchmarks of runxdg, built with -DRUNXDG_BENCH=ON.
+ * malloc(), calloc() and realloc() of the benchmarks count every heap
+ * allocation.
+ */
+
+uint64_t bench_allocs(void);
+
+struct BenchResult {
+  uint64_t ns_per_op;
+  uint64_t allocs;
+};
+
+// runs op n times, op(i) gets the iteration
+template <typename Op>
+BenchResult bench_run (int n, Op op)
+{
+  uint64_t allocs = bench_allocs();
+  uint64_t start = Reactor::now_us();
+
+  for (int i = 0; i < n; ++i)
+    op(i);
+
+  BenchResult result;
+  result.ns_per_op = (Reactor::now_us() - start) * 1000 / (n ? n : 1);
+  result.allocs = bench_allocs() - allocs;
+  return result;
+}
+
+void bench_report(const char *name, int n, const BenchResult& result);
+
+#endif  // BENCH_HPP
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "bench.hpp"
+#include "runxdg.hpp"
+
+/*
+ * Steady state of the WM/HS handler paths of RunXDG: the handlers set
+ * by init_wm() and init_hs() get tap, active, inactive, syncdraw and
+ * flushdraw events built by json-c, send their requests with prebuilt
+ * payloads and get the replies, then focus changes are flushed. Then
+ * Coalescer windows and posted tasks on the reactor. afb-wsj1 and
+ * ilmControl are replaced by loopbacks, no binder nor compositor is
+ * needed. Fails if the steady state allocates.
+ */
+
+#define WARMUP 64
+#define ITERATIONS 100000
+#define WINDOWS 200   // Coalescer windows of 1 msec
+#define IVI_ID 1000   // main surface of the app
+#define REQUESTS 2    // per iteration, ActivateSurface and EndDraw
+
+static const char kConfig[] =
+  "[application]\n"
+  "role = \"bench\"\n"
+  "method = \"POSIX\"\n"
+  "path = \"/bin/true\"\n"
+  "\n"
+  "# every tap and focus change is applied, none coalesced\n"
+  "[coalesce]\n"
+  "window = 0\n";
+
+struct afb_wsj1 {
+  struct afb_wsj1_itf *itf;
+  void *closure;
+};
+
+struct afb_wsj1_msg {
+  json_object *object;
+  void (*on_reply)(void *closure, struct afb_wsj1_msg *msg);
+  void *closure;
+};
+
+static struct afb_wsj1 g_wsj1;
+static struct afb_wsj1_msg g_replies[64];
+static size_t g_pending;  // replies not delivered yet
+static uint64_t g_requests;
+
+extern "C" {
+
+struct afb_wsj1* afb_ws_client_connect_wsj1 (struct sd_event *loop,
+                                             const char *uri,
+                                             struct afb_wsj1_itf *itf,
+                                             void *closure)
+{
+  g_wsj1.itf = itf;
+  g_wsj1.closure = closure;
+  return &g_wsj1;
+}
+
+int afb_wsj1_call_j (struct afb_wsj1 *wsj1, const char *api,
+                     const char *verb, struct json_object *object,
+                     void (*on_reply)(void *closure, struct afb_wsj1_msg *msg),
+                     void *closure)
+{
+  if (g_pending == sizeof(g_replies) / sizeof(g_replies[0]))
+    return -1;
+
+  // sent and answered at once
+  g_requests++;
+  json_object_put(object);
+  struct afb_wsj1_msg& reply = g_replies[g_pending++];
+  reply.object = nullptr;
+  reply.on_reply = on_reply;
+  reply.closure = closure;
+  return 0;
+}
+
+void afb_wsj1_unref (struct afb_wsj1 *wsj1)
+{
+}
+
+int afb_wsj1_msg_is_reply_ok (struct afb_wsj1_msg *msg)
+{
+  return 1;
+}
+
+struct json_object* afb_wsj1_msg_object_j (struct afb_wsj1_msg *msg)
+{
+  return msg->object;
+}
+
+void afb_wsj1_msg_unref (struct afb_wsj1_msg *msg)
+{
+}
+
+// no compositor, no surface but the one the benchmark sets
+ilmErrorTypes ilm_init (void)
+{
+  return ILM_SUCCESS;
+}
+
+ilmErrorTypes ilm_destroy (void)
+{
+  return ILM_SUCCESS;
+}
+
+ilmErrorTypes ilm_registerNotification (notificationFunc callback,
+                                        void *user_data)
+{
+  return ILM_SUCCESS;
+}
+
+ilmErrorTypes ilm_unregisterNotification (void)
+{
+  return ILM_SUCCESS;
+}
+
+ilmErrorTypes ilm_getSurfaceIDs (t_ilm_int *count, t_ilm_surface **ids)
+{
+  *count = 0;
+  *ids = nullptr;
+  return ILM_SUCCESS;
+}
+
+ilmErrorTypes ilm_getPropertiesOfSurface (t_ilm_uint id,
+                                          struct ilmSurfaceProperties *props)
+{
+  return ILM_FAILED;
+}
+
+ilmErrorTypes ilm_surfaceAddNotification (t_ilm_surface id,
+                                          surfaceNotificationFunc callback)
+{
+  return ILM_SUCCESS;
+}
+
+ilmErrorTypes ilm_setInputFocus (t_ilm_surface *ids, t_ilm_uint count,
+                                 ilmInputDevice devices, t_ilm_bool set)
+{
+  return ILM_SUCCESS;
+}
+
+ilmErrorTypes ilm_commitChanges (void)
+{
+  return ILM_SUCCESS;
+}
+
+}
+
+static void deliver_replies (void)
+{
+  for (size_t i = 0; i < g_pending; ++i)
+    g_replies[i].on_reply(g_replies[i].closure, &g_replies[i]);
+  g_pending = 0;
+}
+
+// an event as afb-wsj1 gets it, {"data": {key: value}}
+static struct afb_wsj1_msg new_event (const char *key, const char *value)
+{
+  json_object *data = json_object_new_object();
+  json_object_object_add(data, key, json_object_new_string(value));
+
+  struct afb_wsj1_msg msg = {};
+  msg.object = json_object_new_object();
+  json_object_object_add(msg.object, "data", data);
+  return msg;
+}
+
+struct WindowBench {
+  Reactor& reactor;
+  Coalescer<bool> coalescer;
+  int applied = 0;
+  int window = 0;
+  uint64_t allocs = 0;
+  uint64_t start = 0;
+
+  WindowBench(Reactor& r)
+    : reactor(r),
+      coalescer(r, "bench", false, [this](const bool& state) {
+        // 2nd of the window, its end: the next one is posted
+        if (++applied % 2 == 0)
+          reactor.post([this]() { next(); });
+      }) {
+    coalescer.set_window(1);
+  }
+
+  void next(void) {
+    if (window == WARMUP) {
+      allocs = bench_allocs();
+      start = Reactor::now_us();
+    } else if (window == WARMUP + WINDOWS) {
+      BenchResult result;
+      result.ns_per_op = (Reactor::now_us() - start) * 1000 / WINDOWS;
+      result.allocs = bench_allocs() - allocs;
+      bench_report("coalescer window + post", WINDOWS, result);
+      allocs = result.allocs;
+      reactor.quit();
+      return;
+    }
+
+    // applied at once, then wanted until the end of the window
+    bool state = window++ % 2;
+    coalescer.request(state);
+    coalescer.request(!state);
+  }
+};
+
+// a friend of RunXDG
+class HandlerBench
+{
+  public:
+    HandlerBench(RunXDG& runxdg) : m_runxdg(runxdg) {}
+
+    int run(void);
+
+  private:
+    RunXDG& m_runxdg;
+
+    int handlers(void);
+};
+
+int HandlerBench::handlers (void)
+{
+  RunXDG& runxdg = m_runxdg;
+  const char *role = runxdg.m_role.c_str();
+  struct {
+    const char *name;
+    struct afb_wsj1_msg msg;
+  } events[] = {
+    { "homescreen/tap_shortcut", new_event("application_name", role) },
+    { "windowmanager/active", new_event("drawing_name", role) },
+    { "windowmanager/inactive", new_event("drawing_name", role) },
+    { "windowmanager/syncdraw", new_event("drawing_name", role) },
+    { "windowmanager/flushdraw", new_event("drawing_name", role) },
+  };
+
+  auto op = [&](int i) {
+    for (auto& event : events)
+      g_wsj1.itf->on_event(g_wsj1.closure, event.name, &event.msg);
+    deliver_replies();
+    runxdg.m_ic->flush();
+  };
+
+  // runxdg logs every event, to /dev/null meanwhile
+  int err = dup(STDERR_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDERR_FILENO);
+
+  g_requests = 0;
+  bench_run(WARMUP, op);
+  BenchResult result = bench_run(ITERATIONS, op);
+
+  dup2(err, STDERR_FILENO);
+  close(err);
+  close(null);
+
+  bench_report("wm/hs event/request/reply", ITERATIONS, result);
+
+  for (auto& event : events)
+    json_object_put(event.msg.object);
+
+  uint64_t expected = (uint64_t)REQUESTS * (WARMUP + ITERATIONS);
+  if (g_requests != expected) {
+    fprintf(stderr, "%llu requests out of %llu\n",
+            (unsigned long long)g_requests, (unsigned long long)expected);
+    return -1;
+  }
+  return result.allocs ? -1 : 0;
+}
+
+int HandlerBench::run (void)
+{
+  RunXDG& runxdg = m_runxdg;
+  int ret = 0;
+
+  if (runxdg.init_wm() || runxdg.init_hs())
+    return 1;
+
+  // The app is up and its main surface registered to WM: events are
+  // handled at once, not queued as intents.
+  runxdg.m_ivi_id = IVI_ID;
+  runxdg.m_registered = true;
+  runxdg.m_lifecycle.enter(Lifecycle::STATE_BACKGROUND);
+
+  WindowBench windows(runxdg.m_reactor);
+  runxdg.m_afb.connect(0, "", [&](int result) {
+    if (result || handlers())
+      ret = 1;
+    windows.next();
+  });
+  runxdg.m_reactor.run();
+
+  if (windows.allocs)
+    ret = 1;
+  return ret;
+}
+
+int main (int argc, const char* argv[])
+{
+  // RunXDG reads its config in AFM_APP_INSTALL_DIR
+  char dir[] = "/tmp/bench_handlers.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::string path = std::string(dir) + "/runxdg.toml";
+  FILE *fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    perror(path.c_str());
+    rmdir(dir);
+    return 1;
+  }
+  fputs(kConfig, fp);
+  fclose(fp);
+  setenv("AFM_APP_INSTALL_DIR", dir, 1);
+
+  RunXDG runxdg(0, "", "bench");
+  unlink(path.c_str());
+  rmdir(dir);
+
+  int ret = HandlerBench(runxdg).run();
+  if (ret)
+    fprintf(stderr, "handler paths allocate in steady state\n");
+  return ret;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "bench.hpp"
+#include "surface_registry.hpp"
+
+/*
+ * Cost of creating and destroying surfaces in SurfaceRegistry, with a
+ * few surfaces per process and with a few hundreds, as popups and
+ * subprocesses of a browser create. Destroys come in random order.
+ * Constant costs across sizes show add() and remove() are O(1).
+ */
+
+#define PIDS 8       // in PIDS / 2 process groups
+#define CHURN 100000
+
+static uint32_t g_seed = 1;
+
+static uint32_t next_random (void)
+{
+  // xorshift, same sequence every run
+  g_seed ^= g_seed << 13;
+  g_seed ^= g_seed >> 17;
+  g_seed ^= g_seed << 5;
+  return g_seed;
+}
+
+static void shuffle (std::vector<t_ilm_surface>& ids)
+{
+  for (size_t i = ids.size(); i > 1; --i)
+    std::swap(ids[i - 1], ids[next_random() % i]);
+}
+
+static void add_surface (SurfaceRegistry& registry, t_ilm_surface id)
+{
+  struct ilmSurfaceProperties props;
+
+  memset(&props, 0, sizeof(props));
+  props.creatorPid = 1000 + id % PIDS;
+  registry.add(id, props, 1000 + (id % PIDS) / 2 * 2);
+}
+
+static int bench_size (int per_pid)
+{
+  SurfaceRegistry registry;
+  int count = per_pid * PIDS;
+  std::vector<t_ilm_surface> ids;
+  char name[64];
+
+  for (int i = 0; i < count; ++i)
+    ids.push_back(i + 1);
+  shuffle(ids);
+
+  BenchResult create = bench_run(count, [&](int i) {
+    add_surface(registry, ids[i]);
+  });
+  snprintf(name, sizeof(name), "create, %d per pid", per_pid);
+  bench_report(name, count, create);
+
+  // popups come and go while the others stay
+  BenchResult churn = bench_run(CHURN, [&](int i) {
+    size_t slot = next_random() % ids.size();
+    registry.remove(ids[slot]);
+    ids[slot] = count + i + 1;
+    add_surface(registry, ids[slot]);
+  });
+  snprintf(name, sizeof(name), "destroy+create, %d per pid", per_pid);
+  bench_report(name, CHURN, churn);
+
+  // every lookup runxdg makes, still right after the churn
+  for (t_ilm_surface id : ids) {
+    const SurfaceRegistry::Surface *surface = registry.find(id);
+    if (!surface || surface->pid != (pid_t)(1000 + id % PIDS) ||
+        !registry.find_by_pid(surface->pid) ||
+        !registry.find_by_pgid(surface->pgid)) {
+      fprintf(stderr, "surface %u lost\n", id);
+      return -1;
+    }
+  }
+
+  shuffle(ids);
+  BenchResult destroy = bench_run(count, [&](int i) {
+    registry.remove(ids[i]);
+  });
+  snprintf(name, sizeof(name), "destroy, %d per pid", per_pid);
+  bench_report(name, count, destroy);
+
+  if (registry.size() || registry.find_by_pid(1000) ||
+      registry.find_by_pgid(1000)) {
+    fprintf(stderr, "surfaces left after destroying all\n");
+    return -1;
+  }
+  return 0;
+}
+
+// runxdg.cpp is not linked, benchmarks only show warnings
+void fatal (const char* format, ...)
+{
+  va_list va_args;
+  va_start(va_args, format);
+  vfprintf(stderr, format, va_args);
+  va_end(va_args);
+
+  exit(EXIT_FAILURE);
+}
+
+void warn (const char* format, ...)
+{
+  va_list va_args;
+  va_start(va_args, format);
+  vfprintf(stderr, format, va_args);
+  va_end(va_args);
+}
+
+void debug (const char* format, ...)
+{
+}
+
+int main (int argc, const char* argv[])
+{
+  static const int sizes[] = { 4, 64, 512 };
+  int ret = 0;
+
+  for (int per_pid : sizes) {
+    if (bench_size(per_pid))
+      ret = 1;
+  }
+  return ret;
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <string.h>
+
+#include "runxdg.hpp"
+#include "afb_client.hpp"
+#include "metrics.hpp"
+#include "reactor.hpp"
+
+AFBClient::AFBClient (Reactor& reactor)
+  : m_reactor(reactor),
+    m_inflight_max(metrics().counter("afb.inflight_max")),
+    m_errors(metrics().counter("afb.errors")),
+    m_event_count(metrics().counter("afb.events")),
+    m_rtt(metrics().sample("afb.rtt_us"))
+{
+  m_itf.on_hangup = on_hangup;
+  m_itf.on_call = on_call;
+  m_itf.on_event = on_event;
+}
+
+AFBClient::~AFBClient (void)
+{
+  if (m_connector.joinable())
+    m_connector.join();
+  if (m_wsj1)
+    afb_wsj1_unref(m_wsj1);
+  if (m_loop) {
+    m_reactor.remove_fd(sd_event_get_fd(m_loop));
+    sd_event_unref(m_loop);
+  }
+  for (Request *req : m_free)
+    delete req;
+}
+
+void AFBClient::connect (int port, const std::string& token,
+                         ConnectHandler done)
+{
+  if (m_wsj1) {
+    done(0);
+    return;
+  }
+  if (m_connector.joinable())
+    return;  // done by the connection under way
+
+  std::string uri = "ws://localhost:" + std::to_string(port) +
+                    "/api?token=" + token;
+
+  m_connector = std::thread([this, uri, done]() {
+    sd_event *loop = nullptr;
+    struct afb_wsj1 *wsj1 = nullptr;
+
+    // A loop of its own, nothing dispatches it until installed in the
+    // reactor: no callback of m_itf runs on this thread.
+    if (sd_event_new(&loop) < 0) {
+      AGL_WARN("cannot create sd_event");
+      loop = nullptr;
+    } else {
+      wsj1 = afb_ws_client_connect_wsj1(loop, uri.c_str(), &m_itf, this);
+      if (wsj1 == nullptr)
+        AGL_WARN("cannot connect to %s", uri.c_str());
+    }
+
+    m_reactor.post([this, loop, wsj1, done]() mutable {
+      install(loop, wsj1, done);
+    });
+  });
+}
+
+void AFBClient::install (sd_event *loop, struct afb_wsj1 *wsj1,
+                         ConnectHandler& done)
+{
+  m_connector.join();
+
+  if (wsj1 == nullptr) {
+    if (loop)
+      sd_event_unref(loop);
+    done(-1);
+    return;
+  }
+
+  // the loop of the previous connection, if any, serves nothing anymore
+  if (m_loop) {
+    m_reactor.remove_fd(sd_event_get_fd(m_loop));
+    sd_event_unref(m_loop);
+  }
+  m_loop = loop;
+  m_wsj1 = wsj1;
+
+  // The websocket is served by sd_event, which runs on the reactor
+  m_reactor.add_fd(sd_event_get_fd(m_loop), EPOLLIN,
+                   [this](uint32_t events) { dispatch(); });
+
+  done(0);
+}
+
+void AFBClient::dispatch (void)
+{
+  for (;;) {
+    int ret = sd_event_prepare(m_loop);
+    if (ret == 0)
+      ret = sd_event_wait(m_loop, 0);
+    if (ret <= 0)
+      break;
+    sd_event_dispatch(m_loop);
+  }
+}
+
+int AFBClient::call (const char *api, const char *verb, json_object *args,
+                     ReplyHandler handler)
+{
+  if (!m_wsj1) {
+    json_object_put(args);
+    return -1;
+  }
+
+  Request *req = new_request(handler);
+
+  // Doesn't wait for the reply, following calls are pipelined
+  if (afb_wsj1_call_j(m_wsj1, api, verb, args, on_reply, req) < 0) {
+    AGL_WARN("cannot call %s/%s", api, verb);
+    free_request(req);
+    return -1;
+  }
+
+  m_inflight++;
+  if ((uint64_t)m_inflight > m_inflight_max)
+    m_inflight_max = m_inflight;
+
+  return 0;
+}
+
+AFBClient::Request* AFBClient::new_request (ReplyHandler& handler)
+{
+  Request *req;
+
+  if (m_free.empty()) {
+    req = new Request;
+    req->client = this;
+  } else {
+    req = m_free.back();
+    m_free.pop_back();
+  }
+
+  req->handler.swap(handler);
+  req->sent = Reactor::now_us();
+  return req;
+}
+
+void AFBClient::free_request (Request *req)
+{
+  req->handler = nullptr;
+  m_free.push_back(req);
+}
+
+void AFBClient::on_reply (void *closure, struct afb_wsj1_msg *msg)
+{
+  Request *req = static_cast<Request*>(closure);
+  AFBClient *client = req->client;
+  bool ok = afb_wsj1_msg_is_reply_ok(msg);
+
+  client->m_inflight--;
+  client->m_rtt.add(Reactor::now_us() - req->sent);
+  if (!ok)
+    client->m_errors++;
+
+  if (req->handler)
+    req->handler(ok, afb_wsj1_msg_object_j(msg));
+
+  client->free_request(req);
+  afb_wsj1_msg_unref(msg);
+}
+
+void AFBClient::on_hangup (void *closure, struct afb_wsj1 *wsj1)
+{
+  AFBClient *client = static_cast<AFBClient*>(closure);
+
+  AGL_WARN("binder connection hung up");
+  afb_wsj1_unref(client->m_wsj1);
+  client->m_wsj1 = nullptr;
+
+  // requests in flight are never replied, subscriptions are gone
+  client->m_inflight = 0;
+  metrics().counter("afb.hangups")++;
+  if (client->m_on_hangup)
+    client->m_on_hangup();
+}
+
+void AFBClient::on_call (void *closure, const char *api, const char *verb,
+                         struct afb_wsj1_msg *msg)
+{
+  // runxdg serves no verb
+  afb_wsj1_msg_unref(msg);
+}
+
+void AFBClient::set_event_handler (const char *event, EventHandler handler)
+{
+  for (auto& entry : m_events) {
+    if (entry.first == event) {
+      entry.second = handler;
+      return;
+    }
+  }
+  m_events.emplace_back(event, handler);
+}
+
+void AFBClient::on_event (void *closure, const char *event,
+                          struct afb_wsj1_msg *msg)
+{
+  AFBClient *client = static_cast<AFBClient*>(closure);
+  json_object *data = nullptr;
+
+  client->m_event_count++;
+  json_object_object_get_ex(afb_wsj1_msg_object_j(msg), "data", &data);
+
+  // a handful of events, no need of hashing (nor of a std::string)
+  for (auto& entry : client->m_events) {
+    if (strcmp(entry.first.c_str(), event) == 0) {
+      if (entry.second)
+        entry.second(data);
+      break;
+    }
+  }
+
+  afb_wsj1_msg_unref(msg);
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef AFB_CLIENT_HPP
+#define AFB_CLIENT_HPP
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <json-c/json.h>
+
+#include "metrics.hpp"
+
+extern "C" {
+#include <afb/afb-wsj1.h>
+#include <afb/afb-ws-client.h>
+#include <systemd/sd-event.h>
+}
+
+class Reactor;
+
+/*
+ * Asynchronous client of the binder over websocket.
+ * Requests to every API are pipelined on one connection, replies and
+ * events are handled in the reactor.
+ */
+class AFBClient
+{
+  public:
+    // reply is owned by the client, valid only during the call
+    typedef std::function<void(bool ok, json_object *reply)> ReplyHandler;
+    // data is owned by the client, valid only during the call
+    typedef std::function<void(json_object *data)> EventHandler;
+    // result is 0 once connected, -1 if the connection failed
+    typedef std::function<void(int result)> ConnectHandler;
+
+    AFBClient(Reactor& reactor);
+    ~AFBClient(void);
+
+    // TCP connect and websocket upgrade block, they run on a thread of
+    // their own; done is called in the reactor
+    void connect(int port, const std::string& token, ConnectHandler done);
+    bool connected(void) const { return m_wsj1 != nullptr; }
+
+    // takes ownership of args
+    int call(const char *api, const char *verb, json_object *args,
+             ReplyHandler handler);
+
+    // event is "api/name", subscription is up to the caller
+    void set_event_handler(const char *event, EventHandler handler);
+
+    // connection lost, connect() again to recover
+    std::function<void(void)> m_on_hangup;
+
+  private:
+    struct Request {
+      AFBClient *client;
+      ReplyHandler handler;
+      uint64_t sent;
+    };
+
+    Reactor& m_reactor;
+    sd_event *m_loop = nullptr;
+    struct afb_wsj1 *m_wsj1 = nullptr;
+    struct afb_wsj1_itf m_itf;
+    int m_inflight = 0;
+    std::vector<Request*> m_free;  // recycled, a call allocates none
+    std::vector<std::pair<std::string, EventHandler>> m_events;
+    std::thread m_connector;
+
+    // looked up once, calls and events build no metric name
+    uint64_t& m_inflight_max;
+    uint64_t& m_errors;
+    uint64_t& m_event_count;
+    Metrics::Sample& m_rtt;
+
+    void install(sd_event *loop, struct afb_wsj1 *wsj1,
+                 ConnectHandler& done);
+    void dispatch(void);
+    Request* new_request(ReplyHandler& handler);
+    void free_request(Request *req);
+
+    static void on_hangup(void *closure, struct afb_wsj1 *wsj1);
+    static void on_call(void *closure, const char *api, const char *verb,
+                        struct afb_wsj1_msg *msg);
+    static void on_event(void *closure, const char *event,
+                         struct afb_wsj1_msg *msg);
+    static void on_reply(void *closure, struct afb_wsj1_msg *msg);
+};
+
+#endif  // AFB_CLIENT_HPP
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef COALESCER_HPP
+#define COALESCER_HPP
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+#include "metrics.hpp"
+#include "reactor.hpp"
+
+/*
+ * Collapses a burst of requests into the final intended state.
+ *
+ * The first request of a burst is applied at once. Following ones
+ * within the window only update the wanted state, which is applied at
+ * the end of the window if it differs from what was applied. With
+ * 'sticky', a request equal to the applied state is always dropped,
+ * in or out of a window.
+ */
+template <typename T>
+class Coalescer
+{
+  public:
+    typedef std::function<void(const T& state)> Apply;
+
+    Coalescer(Reactor& reactor, const std::string& name, bool sticky,
+              Apply apply)
+      : m_reactor(reactor), m_sticky(sticky), m_apply(apply),
+        m_applied_count(metrics().counter("coalesce." + name + ".applied")),
+        m_suppressed(metrics().counter("coalesce." + name + ".suppressed")) {
+      // armed for every window, created once
+      m_timer = m_reactor.create_timer([this]() { end_window(); });
+    }
+
+    ~Coalescer(void) { m_reactor.cancel_timer(m_timer); }
+
+    void set_window(uint64_t window_ms) { m_window = window_ms; }
+
+    void request(const T& state) {
+      if (m_armed) {
+        // in a burst, apply at the end of the window
+        m_wanted = state;
+        m_pending = true;
+        m_suppressed++;
+        return;
+      }
+
+      if (m_sticky && m_valid && state == m_applied) {
+        m_suppressed++;
+        return;
+      }
+
+      apply(state);
+
+      if (m_window && m_timer >= 0) {
+        m_armed = true;
+        m_reactor.arm_timer(m_timer, m_window);
+      }
+    }
+
+    // forget what was applied, e.g. the target has changed
+    void reset(void) {
+      m_reactor.disarm_timer(m_timer);
+      m_armed = false;
+      m_pending = false;
+      m_valid = false;
+    }
+
+  private:
+    Reactor& m_reactor;
+    bool m_sticky;
+    Apply m_apply;
+    uint64_t m_window = 0;
+    int m_timer = -1;
+    bool m_armed = false;
+
+    T m_applied = T();
+    T m_wanted = T();
+    bool m_valid = false;
+    bool m_pending = false;
+
+    uint64_t& m_applied_count;
+    uint64_t& m_suppressed;
+
+    void end_window(void) {
+      m_armed = false;
+      if (m_pending) {
+        m_pending = false;
+        if (!(m_valid && m_wanted == m_applied)) {
+          m_suppressed--;  // the last one takes effect after all
+          apply(m_wanted);
+        }
+      }
+    }
+
+    void apply(const T& state) {
+      m_applied = state;
+      m_valid = true;
+      m_applied_count++;
+      m_apply(state);
+    }
+};
+
+#endif  // COALESCER_HPP
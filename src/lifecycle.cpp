@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sstream>
+
+#include "runxdg.hpp"
+#include "lifecycle.hpp"
+#include "metrics.hpp"
+#include "reactor.hpp"
+
+Lifecycle::Lifecycle (Reactor& reactor)
+  : m_reactor(reactor), m_since(Reactor::now_us())
+{
+  m_timer = m_reactor.create_timer([this]() { timeout(); });
+
+  // idle is not reported, it has no duration
+  m_durations[STATE_IDLE] = nullptr;
+  for (int i = 0; i < NUM_STATES; ++i) {
+    std::string state = name((State)i);
+    m_timeouts[i] = &metrics().counter("lifecycle.timeout." + state);
+    if (i != STATE_IDLE)
+      m_durations[i] = &metrics().sample("lifecycle." + state + "_ms");
+  }
+}
+
+Lifecycle::~Lifecycle (void)
+{
+  m_reactor.cancel_timer(m_timer);
+}
+
+const char* Lifecycle::name (State state)
+{
+  switch (state) {
+    case STATE_IDLE:            return "idle";
+    case STATE_SPAWNING:        return "spawning";
+    case STATE_WAITING_SURFACE: return "waiting-for-surface";
+    case STATE_REGISTERING:     return "registering";
+    case STATE_ACTIVE:          return "active";
+    case STATE_BACKGROUND:      return "background";
+    case STATE_EXITING:         return "exiting";
+    default:                    return "unknown";
+  }
+}
+
+Lifecycle::Recovery Lifecycle::parse_recovery (const std::string& str)
+{
+  if (str == "relaunch")
+    return RECOVERY_RELAUNCH;
+  if (str == "kill")
+    return RECOVERY_KILL;
+  if (!str.empty() && str != "none")
+    AGL_WARN("unknown recovery (%s), ignore timeout", str.c_str());
+
+  return RECOVERY_NONE;
+}
+
+void Lifecycle::enter (State state)
+{
+  uint64_t now = Reactor::now_us();
+
+  if (state == m_state)
+    return;
+
+  if (m_state != STATE_IDLE)
+    m_elapsed[m_state] += now - m_since;
+
+  AGL_DEBUG("lifecycle: %s -> %s (%llu ms)", name(m_state), name(state),
+            (unsigned long long)(now - m_since) / 1000);
+
+  m_state = state;
+  m_since = now;
+
+  m_reactor.disarm_timer(m_timer);
+  if (m_deadlines[state])
+    m_reactor.arm_timer(m_timer, m_deadlines[state]);
+}
+
+void Lifecycle::timeout (void)
+{
+  State state = m_state;
+
+  AGL_WARN("lifecycle: deadline of %s (%llu ms) missed", name(state),
+           (unsigned long long)m_deadlines[state]);
+  (*m_timeouts[state])++;
+  if (m_on_timeout)
+    m_on_timeout(state);
+}
+
+void Lifecycle::report (void)
+{
+  std::ostringstream os;
+
+  if (m_state != STATE_IDLE) {
+    uint64_t now = Reactor::now_us();
+    m_elapsed[m_state] += now - m_since;
+    m_since = now;
+  }
+
+  for (int i = STATE_SPAWNING; i < NUM_STATES; ++i) {
+    uint64_t ms = m_elapsed[i] / 1000;
+    os << " " << name((State)i) << "=" << ms << "ms";
+    m_durations[i]->add(ms);
+    m_elapsed[i] = 0;
+  }
+
+  AGL_DEBUG("lifecycle: launch #%d:%s", ++m_launches, os.str().c_str());
+}
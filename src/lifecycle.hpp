@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef LIFECYCLE_HPP
+#define LIFECYCLE_HPP
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+#include "metrics.hpp"
+
+class Reactor;
+
+/*
+ * State of the launched app, with a deadline per state.
+ * Time spent in each state is reported for every launch.
+ */
+class Lifecycle
+{
+  public:
+    enum State {
+      STATE_IDLE,
+      STATE_SPAWNING,
+      STATE_WAITING_SURFACE,
+      STATE_REGISTERING,
+      STATE_ACTIVE,
+      STATE_BACKGROUND,
+      STATE_EXITING,
+      NUM_STATES
+    };
+
+    enum Recovery {
+      RECOVERY_NONE,
+      RECOVERY_RELAUNCH,
+      RECOVERY_KILL
+    };
+
+    typedef std::function<void(State state)> TimeoutHandler;
+
+    Lifecycle(Reactor& reactor);
+    ~Lifecycle(void);
+
+    void set_deadline(State state, uint64_t timeout_ms) {
+      m_deadlines[state] = timeout_ms;
+    }
+    void set_timeout_handler(TimeoutHandler handler) {
+      m_on_timeout = handler;
+    }
+
+    void enter(State state);
+    State state(void) const { return m_state; }
+
+    // log and export time spent in each state, then start over
+    void report(void);
+
+    static const char* name(State state);
+    static Recovery parse_recovery(const std::string& str);
+
+  private:
+    Reactor& m_reactor;
+    State m_state = STATE_IDLE;
+    uint64_t m_since = 0;
+    int m_timer = -1;  // deadline of m_state, armed again by enter()
+    int m_launches = 0;
+
+    uint64_t m_deadlines[NUM_STATES] = {};  // msec, 0: no deadline
+    uint64_t m_elapsed[NUM_STATES] = {};    // usec, for current launch
+
+    // lifecycle.timeout.<state> and lifecycle.<state>_ms, looked up once
+    uint64_t *m_timeouts[NUM_STATES];
+    Metrics::Sample *m_durations[NUM_STATES];
+
+    TimeoutHandler m_on_timeout;
+
+    void timeout(void);
+};
+
+#endif  // LIFECYCLE_HPP
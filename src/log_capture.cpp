@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <algorithm>
+
+#include "runxdg.hpp"
+#include "log_capture.hpp"
+#include "metrics.hpp"
+#include "reactor.hpp"
+
+#define JOURNAL_STDOUT "/run/systemd/journal/stdout"
+#define PIPE_SIZE      (1024 * 1024)
+
+LogCapture::LogCapture (Target target, const std::string& ident,
+                        const std::string& path, off_t max_size, int rotate)
+  : m_target(target), m_ident(ident), m_path(path),
+    m_max_size(max_size), m_rotate(rotate)
+{
+  m_streams[0].priority = 6;  // LOG_INFO
+  m_streams[0].child_fd = STDOUT_FILENO;
+  m_streams[1].priority = 3;  // LOG_ERR
+  m_streams[1].child_fd = STDERR_FILENO;
+}
+
+LogCapture::~LogCapture (void)
+{
+  stop();
+}
+
+LogCapture::Target LogCapture::parse_target (const std::string& str)
+{
+  if (str == "file")
+    return TARGET_FILE;
+  if (str == "journal")
+    return TARGET_JOURNAL;
+  if (str == "both")
+    return TARGET_BOTH;
+  if (!str.empty() && str != "inherit")
+    AGL_WARN("unknown log target (%s), inherit stdout/stderr", str.c_str());
+
+  return TARGET_INHERIT;
+}
+
+int LogCapture::open_file (bool append)
+{
+  struct stat st;
+
+  // The log of a launch which failed is kept across the relaunch, it's
+  // appended to. Not O_APPEND, splice() writes at m_file_off.
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC);
+  m_file = open(m_path.c_str(), flags, 0644);
+  if (m_file < 0) {
+    AGL_WARN("cannot open %s (%s)", m_path.c_str(), strerror(errno));
+    return -1;
+  }
+  m_file_off = (append && fstat(m_file, &st) == 0) ? st.st_size : 0;
+
+  if (m_file_off >= m_max_size) {
+    rotate_file();
+    return m_file < 0 ? -1 : 0;
+  }
+
+  return 0;
+}
+
+void LogCapture::rotate_file (void)
+{
+  close(m_file);
+  m_file = -1;
+
+  // path.(n-1) -> path.n, ..., path -> path.1
+  for (int i = m_rotate; i > 0; --i) {
+    std::string from = (i == 1) ? m_path : m_path + "." + std::to_string(i - 1);
+    std::string to = m_path + "." + std::to_string(i);
+    rename(from.c_str(), to.c_str());
+  }
+
+  open_file(false);
+}
+
+int LogCapture::open_journal (Stream& stream)
+{
+  struct sockaddr_un addr;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, JOURNAL_STDOUT, sizeof(addr.sun_path) - 1);
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    AGL_WARN("cannot connect to journal (%s)", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  shutdown(fd, SHUT_RD);
+
+  // identifier, unit id, priority, level prefix, syslog, kmsg, console
+  std::string header = m_ident + "\n\n" + std::to_string(stream.priority) +
+                       "\n0\n0\n0\n0\n";
+  if (write(fd, header.c_str(), header.size()) != (ssize_t)header.size()) {
+    close(fd);
+    return -1;
+  }
+
+  // Never let a slow journal push back on the app
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  stream.journal = fd;
+
+  return 0;
+}
+
+int LogCapture::setup (void)
+{
+  if (m_target == TARGET_INHERIT)
+    return 0;
+
+  m_null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (m_null < 0) {
+    AGL_WARN("cannot setup log capture (%s)", strerror(errno));
+    return -1;
+  }
+
+  if (m_target == TARGET_FILE || m_target == TARGET_BOTH) {
+    if (open_file(true))
+      return -1;
+  }
+
+  for (Stream& stream : m_streams) {
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+      AGL_WARN("cannot create pipe (%s)", strerror(errno));
+      return -1;
+    }
+    stream.rd = fds[0];
+    stream.wr = fds[1];
+
+    // The app's end stays blocking, as stdout/stderr are expected to be
+    // (EAGAIN would lose or abort its output): the app waits on a full
+    // pipe until the reactor drains it. Room to burst meanwhile, up to
+    // /proc/sys/fs/pipe-max-size.
+    if (fcntl(stream.rd, F_SETPIPE_SZ, PIPE_SIZE) < 0) {
+      AGL_WARN("cannot enlarge log pipe (%s), %d bytes", strerror(errno),
+               fcntl(stream.rd, F_GETPIPE_SZ));
+    }
+    fcntl(stream.rd, F_SETFL, fcntl(stream.rd, F_GETFL) | O_NONBLOCK);
+
+    if (m_target == TARGET_JOURNAL || m_target == TARGET_BOTH) {
+      if (open_journal(stream))
+        return -1;
+    }
+
+    if (m_target == TARGET_BOTH) {
+      if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0)
+        return -1;
+      stream.tee_rd = fds[0];
+      stream.tee_wr = fds[1];
+    }
+  }
+
+  return 0;
+}
+
+void LogCapture::setup_child (void)
+{
+  if (m_target == TARGET_INHERIT)
+    return;
+
+  for (Stream& stream : m_streams) {
+    dup2(stream.wr, stream.child_fd);
+  }
+}
+
+void LogCapture::start (Reactor& reactor)
+{
+  if (m_target == TARGET_INHERIT)
+    return;
+
+  m_reactor = &reactor;
+
+  for (Stream& stream : m_streams) {
+    // The write ends belong to the app now
+    close(stream.wr);
+    stream.wr = -1;
+
+    Stream *s = &stream;
+    m_reactor->add_fd(stream.rd, EPOLLIN, [this, s](uint32_t events) {
+      if (events & EPOLLIN) {
+        pump(*s);
+      } else if (events & (EPOLLHUP | EPOLLERR)) {
+        // all writers have gone
+        m_reactor->remove_fd(s->rd);
+      }
+    });
+  }
+}
+
+void LogCapture::stop (void)
+{
+  for (Stream& stream : m_streams) {
+    if (stream.rd >= 0) {
+      // leftover written just before the app exited
+      pump(stream);
+      if (m_reactor)
+        m_reactor->remove_fd(stream.rd);
+    }
+    if (stream.tee_rd >= 0)
+      flush_tee(stream);
+
+    int *fds[] = { &stream.rd, &stream.wr, &stream.tee_rd, &stream.tee_wr,
+                   &stream.journal };
+    for (int *fd : fds) {
+      if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+      }
+    }
+  }
+
+  int *fds[] = { &m_file, &m_null };
+  for (int *fd : fds) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+
+  if (m_dropped) {
+    AGL_WARN("%llu bytes of app log dropped", (unsigned long long)m_dropped);
+    m_dropped = 0;
+  }
+}
+
+void LogCapture::drop (int fd, size_t len)
+{
+  ssize_t ret = splice(fd, NULL, m_null, NULL, len, SPLICE_F_NONBLOCK);
+  if (ret > 0) {
+    m_dropped += ret;
+    metrics().counter("log.dropped_bytes") += ret;
+  }
+}
+
+void LogCapture::flush_tee (Stream& stream)
+{
+  // Leftover stays in the tee pipe; once it is full, tee() fails and
+  // the journal copy gets dropped by pump().
+  ssize_t ret;
+  do {
+    ret = splice(stream.tee_rd, NULL, stream.journal, NULL, PIPE_SIZE,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  } while (ret > 0);
+}
+
+void LogCapture::pump (Stream& stream)
+{
+  int avail = 0;
+
+  if (ioctl(stream.rd, FIONREAD, &avail) < 0 || avail <= 0)
+    return;
+
+  if (m_target == TARGET_BOTH) {
+    // Duplicate for the journal; what doesn't fit in the tee pipe is lost
+    ssize_t ret = tee(stream.rd, stream.tee_wr, avail, SPLICE_F_NONBLOCK);
+    if (ret < avail) {
+      m_dropped += avail - (ret > 0 ? ret : 0);
+      metrics().counter("log.dropped_bytes") += avail - (ret > 0 ? ret : 0);
+    }
+    flush_tee(stream);
+  }
+
+  if (m_target == TARGET_JOURNAL) {
+    ssize_t ret = splice(stream.rd, NULL, stream.journal, NULL, avail,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (ret < avail)
+      drop(stream.rd, avail - (ret > 0 ? ret : 0));
+    return;
+  }
+
+  while (avail > 0) {
+    if (m_file < 0) {
+      drop(stream.rd, avail);
+      break;
+    }
+
+    size_t len = std::min((off_t)avail, m_max_size - m_file_off);
+    ssize_t ret = splice(stream.rd, NULL, m_file, &m_file_off, len,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (ret <= 0) {
+      drop(stream.rd, avail);
+      break;
+    }
+    avail -= ret;
+
+    if (m_file_off >= m_max_size)
+      rotate_file();
+  }
+}
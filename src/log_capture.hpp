@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef LOG_CAPTURE_HPP
+#define LOG_CAPTURE_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+class Reactor;
+
+class LogCapture
+{
+  public:
+    enum Target {
+      TARGET_INHERIT,
+      TARGET_FILE,
+      TARGET_JOURNAL,
+      TARGET_BOTH
+    };
+
+    LogCapture(Target target, const std::string& ident,
+               const std::string& path, off_t max_size, int rotate);
+    ~LogCapture(void);
+
+    int setup(void);        // parent, before fork()
+    void setup_child(void); // child, before exec()
+    void start(Reactor& reactor);  // parent, after fork()
+    void stop(void);
+
+    static Target parse_target(const std::string& str);
+
+  private:
+    struct Stream {
+      int rd = -1;          // pipe from the app
+      int wr = -1;
+      int tee_rd = -1;      // copy of the data for journal (TARGET_BOTH)
+      int tee_wr = -1;
+      int journal = -1;
+      int priority;
+      int child_fd;         // STDOUT_FILENO or STDERR_FILENO
+    };
+
+    Target m_target;
+    std::string m_ident;
+    std::string m_path;
+    off_t m_max_size;
+    int m_rotate;
+
+    Stream m_streams[2];
+
+    int m_file = -1;
+    off_t m_file_off = 0;
+    int m_null = -1;
+
+    Reactor *m_reactor = nullptr;
+    uint64_t m_dropped = 0;  // since the last stop()
+
+    int open_file(bool append);
+    void rotate_file(void);
+    int open_journal(Stream& stream);
+
+    void drop(int fd, size_t len);
+    void pump(Stream& stream);
+    void flush_tee(Stream& stream);
+};
+
+#endif  // LOG_CAPTURE_HPP
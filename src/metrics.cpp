@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sstream>
+
+#include "runxdg.hpp"
+#include "metrics.hpp"
+
+Metrics& metrics (void)
+{
+  static Metrics instance;
+  return instance;
+}
+
+void Metrics::Sample::add (uint64_t value)
+{
+  count++;
+  sum += value;
+  if (value > max)
+    max = value;
+}
+
+std::string Metrics::dump (void) const
+{
+  std::ostringstream os;
+
+  for (const auto& counter : m_counters)
+    os << counter.first << " " << counter.second << "\n";
+
+  for (const auto& sample : m_samples) {
+    const Sample& s = sample.second;
+    os << sample.first << ".count " << s.count << "\n";
+    os << sample.first << ".avg " << (s.count ? s.sum / s.count : 0) << "\n";
+    os << sample.first << ".max " << s.max << "\n";
+  }
+
+  return os.str();
+}
+
+int Metrics::write_file (const std::string& path) const
+{
+  // replace atomically, readers never see a partial file
+  std::string tmp = path + ".tmp";
+  std::string str = dump();
+
+  FILE *fp = fopen(tmp.c_str(), "w");
+  if (fp == NULL) {
+    AGL_WARN("cannot open %s (%s)", tmp.c_str(), strerror(errno));
+    return -1;
+  }
+  fwrite(str.c_str(), 1, str.size(), fp);
+  fclose(fp);
+
+  if (rename(tmp.c_str(), path.c_str()) < 0) {
+    AGL_WARN("cannot rename to %s (%s)", path.c_str(), strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+/*
+ * Counters and samples exported by runxdg.
+ * Not thread safe, only touched from the reactor thread.
+ */
+class Metrics
+{
+  public:
+    struct Sample {
+      uint64_t count = 0;
+      uint64_t sum = 0;
+      uint64_t max = 0;
+
+      void add(uint64_t value);
+    };
+
+    // References stay valid, hot paths look them up once instead of
+    // building a name each time.
+    uint64_t& counter(const std::string& name) { return m_counters[name]; }
+    Sample& sample(const std::string& name) { return m_samples[name]; }
+
+    void set(const std::string& name, uint64_t value) {
+      m_counters[name] = value;
+    }
+    void sample(const std::string& name, uint64_t value) {
+      m_samples[name].add(value);
+    }
+
+    std::string dump(void) const;
+    int write_file(const std::string& path) const;
+
+  private:
+    std::map<std::string, uint64_t> m_counters;
+    std::map<std::string, Sample> m_samples;
+};
+
+Metrics& metrics(void);
+
+#endif  // METRICS_HPP
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "runxdg.hpp"
+#include "metrics.hpp"
+#include "pid_namespace.hpp"
+
+// surfaces of a few apps, entries are forgotten with their surfaces
+#define MAX_CACHE 1024
+
+const std::vector<pid_t>& PidNamespace::nspids (pid_t pid)
+{
+  auto itr = m_cache.find(pid);
+  if (itr != m_cache.end()) {
+    metrics().counter("pidns.hit")++;
+    return itr->second;
+  }
+  metrics().counter("pidns.miss")++;
+
+  if (m_cache.size() >= MAX_CACHE)
+    m_cache.clear();
+
+  std::vector<pid_t>& ids = m_cache[pid];
+
+  std::ifstream ifs("/proc/" + std::to_string(pid) + "/status");
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (line.compare(0, 6, "NSpid:") != 0)
+      continue;
+
+    std::istringstream iss(line.substr(6));
+    pid_t id;
+    while (iss >> id)
+      ids.push_back(id);
+    break;
+  }
+
+  // no NSpid before linux 4.1, or the process is gone
+  if (ids.empty())
+    ids.push_back(pid);
+
+  return ids;
+}
+
+bool PidNamespace::matches (pid_t pid, pid_t inner, uint64_t since)
+{
+  const std::vector<pid_t>& ids = nspids(pid);
+  if (ids.size() < 2 || ids.back() != inner)
+    return false;
+
+  // another namespace than ours for sure, not only a nested NSpid
+  ino_t ns = ns_of(pid);
+  if (ns == 0 || ns == ns_of(getpid()))
+    return false;
+
+  // the container of the app is created by the launch, the ones of other
+  // apps which run already have their processes older than that
+  uint64_t start = start_ticks(pid);
+  if (start < since) {
+    AGL_DEBUG("pid %d is %d in another namespace, older than the app",
+              pid, inner);
+    metrics().counter("pidns.rejected")++;
+    return false;
+  }
+
+  return true;
+}
+
+uint64_t PidNamespace::boot_ticks (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  uint64_t hz = sysconf(_SC_CLK_TCK);
+  // starttime is truncated to a tick, so is this
+  return ts.tv_sec * hz + ts.tv_nsec / (1000000000 / hz);
+}
+
+ino_t PidNamespace::ns_of (pid_t pid)
+{
+  struct stat st;
+  std::string path = "/proc/" + std::to_string(pid) + "/ns/pid";
+
+  if (stat(path.c_str(), &st) < 0)
+    return 0;
+  return st.st_ino;
+}
+
+uint64_t PidNamespace::start_ticks (pid_t pid)
+{
+  std::ifstream ifs("/proc/" + std::to_string(pid) + "/stat");
+  std::string line;
+  if (!std::getline(ifs, line))
+    return 0;
+
+  // comm may have spaces, fields are counted after its ')'
+  size_t pos = line.rfind(')');
+  if (pos == std::string::npos)
+    return 0;
+
+  // state is field 3, starttime field 22
+  std::istringstream iss(line.substr(pos + 1));
+  std::string field;
+  for (int i = 3; i < 22 && (iss >> field); ++i)
+    ;
+  uint64_t start = 0;
+  iss >> start;
+  return start;
+}
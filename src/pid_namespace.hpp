@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef PID_NAMESPACE_HPP
+#define PID_NAMESPACE_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Pids of processes across nested pid namespaces, from the NSpid field of
+ * /proc/<pid>/status. A containerized app is known by its pid inside the
+ * container (e.g. rid of afm), while ILM reports the creator of surfaces
+ * with its pid in runxdg's namespace. Lookups are cached per pid.
+ */
+class PidNamespace
+{
+  public:
+    // pid in each namespace, runxdg's one first and innermost last
+    const std::vector<pid_t>& nspids(pid_t pid);
+    bool nested(pid_t pid) { return nspids(pid).size() > 1; }
+    // Whether pid (ours) is known as inner in a pid namespace other than
+    // ours, and started at or after since (boot_ticks()). The inner pid
+    // alone doesn't tell apps apart, each container may have its pid 1.
+    bool matches(pid_t pid, pid_t inner, uint64_t since);
+
+    static uint64_t boot_ticks(void);  // now, as starttime of /proc/<pid>/stat
+
+    void forget(pid_t pid) { m_cache.erase(pid); }
+
+  private:
+    std::unordered_map<pid_t, std::vector<pid_t>> m_cache;
+
+    static ino_t ns_of(pid_t pid);
+    static uint64_t start_ticks(pid_t pid);
+};
+
+#endif  // PID_NAMESPACE_HPP
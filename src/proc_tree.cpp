@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+
+#include "runxdg.hpp"
+#include "metrics.hpp"
+#include "proc_tree.hpp"
+#include "reactor.hpp"
+
+#define MAX_PENDING 4096
+
+ProcTree::~ProcTree (void)
+{
+  close();
+}
+
+int ProcTree::open (void)
+{
+  if (m_fd >= 0)
+    return 0;
+
+  int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  NETLINK_CONNECTOR);
+  if (fd < 0) {
+    AGL_DEBUG("cannot open proc connector (%s)", strerror(errno));
+    return -1;
+  }
+
+  // events of the whole system, don't lose forks during a burst
+  int size = 1024 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  struct sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  addr.nl_pid = 0;
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    AGL_DEBUG("cannot bind proc connector (%s)", strerror(errno));
+    ::close(fd);
+    return -1;
+  }
+
+  char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))]
+      __attribute__((aligned(NLMSG_ALIGNTO)));
+  memset(buf, 0, sizeof(buf));
+
+  struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+  nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) +
+                                sizeof(enum proc_cn_mcast_op));
+  nlh->nlmsg_type = NLMSG_DONE;
+
+  struct cn_msg *msg = (struct cn_msg *)NLMSG_DATA(nlh);
+  msg->id.idx = CN_IDX_PROC;
+  msg->id.val = CN_VAL_PROC;
+  msg->len = sizeof(enum proc_cn_mcast_op);
+
+  enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+  memcpy(msg->data, &op, sizeof(op));
+
+  if (send(fd, nlh, nlh->nlmsg_len, 0) < 0) {
+    AGL_DEBUG("cannot listen to proc connector (%s)", strerror(errno));
+    ::close(fd);
+    return -1;
+  }
+
+  m_fd = fd;
+  AGL_DEBUG("process tree is fed by proc connector");
+  return 0;
+}
+
+void ProcTree::start (Reactor& reactor)
+{
+  if (m_fd < 0 || m_reactor)
+    return;
+
+  m_reactor = &reactor;
+  m_reactor->add_fd(m_fd, EPOLLIN, [this](uint32_t events) {
+    receive();
+  });
+}
+
+void ProcTree::close (void)
+{
+  if (m_fd < 0)
+    return;
+
+  if (m_reactor) {
+    m_reactor->remove_fd(m_fd);
+    m_reactor = nullptr;
+  }
+  ::close(m_fd);
+  m_fd = -1;
+
+  m_procs.clear();
+  m_pending.clear();
+}
+
+void ProcTree::add (pid_t pid)
+{
+  m_procs.insert(pid);
+
+  // Adopt what the app has forked before its pid was known. Events are
+  // in order, so a parent always precedes its own children.
+  for (const auto& fork : m_pending) {
+    if (m_procs.count(fork.second))
+      m_procs.insert(fork.first);
+  }
+  m_pending.clear();
+}
+
+void ProcTree::clear (void)
+{
+  m_procs.clear();
+  m_pending.clear();
+}
+
+bool ProcTree::owns (pid_t pid)
+{
+  if (m_procs.count(pid))
+    return true;
+
+  // the fork may still be waiting in the socket
+  sync();
+  return m_procs.count(pid);
+}
+
+void ProcTree::forked (pid_t parent, pid_t child)
+{
+  if (m_procs.count(parent)) {
+    m_procs.insert(child);
+  } else if (m_procs.empty() && m_pending.size() < MAX_PENDING) {
+    m_pending.emplace_back(child, parent);
+  }
+}
+
+void ProcTree::receive (void)
+{
+  char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+
+  while (true) {
+    struct sockaddr_nl addr;
+    socklen_t addrlen = sizeof(addr);
+    ssize_t len = recvfrom(m_fd, buf, sizeof(buf), 0,
+                           (struct sockaddr *)&addr, &addrlen);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS) {
+        // events are lost, members may be stale until they exit
+        AGL_WARN("proc connector overrun");
+        metrics().counter("proctree.overrun")++;
+        continue;
+      }
+      return;  // EAGAIN
+    }
+    if (addr.nl_pid != 0)
+      continue;  // not from the kernel
+
+    struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+    for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+      if (nlh->nlmsg_type == NLMSG_NOOP || nlh->nlmsg_type == NLMSG_ERROR)
+        continue;
+
+      struct cn_msg *msg = (struct cn_msg *)NLMSG_DATA(nlh);
+      if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC)
+        continue;
+
+      struct proc_event *ev = (struct proc_event *)msg->data;
+      m_events++;
+
+      switch (ev->what) {
+        case proc_event::PROC_EVENT_FORK:
+          // threads are not processes
+          if (ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid)
+            forked(ev->event_data.fork.parent_tgid,
+                   ev->event_data.fork.child_tgid);
+          break;
+
+        case proc_event::PROC_EVENT_EXEC:
+          if (m_procs.count(ev->event_data.exec.process_tgid))
+            AGL_DEBUG("app process (pid=%d) exec",
+                      ev->event_data.exec.process_tgid);
+          break;
+
+        case proc_event::PROC_EVENT_EXIT:
+          if (ev->event_data.exit.process_pid ==
+              ev->event_data.exit.process_tgid)
+            m_procs.erase(ev->event_data.exit.process_tgid);
+          break;
+
+        default:
+          break;
+      }
+    }
+  }
+}
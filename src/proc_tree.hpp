@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef PROC_TREE_HPP
+#define PROC_TREE_HPP
+
+#include <sys/types.h>
+
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "metrics.hpp"
+
+class Reactor;
+
+/*
+ * Live index of the processes of the app, fed by fork/exec/exit events
+ * of the netlink proc connector. Any descendant of a root is a member,
+ * so that a surface created by a child process (e.g. chromium) can be
+ * attributed to the app without scanning /proc.
+ *
+ * Subscribing needs CAP_NET_ADMIN, callers fall back to their own
+ * lookup when open() fails.
+ */
+class ProcTree
+{
+  public:
+    ~ProcTree(void);
+
+    int open(void);                // subscribe, before the app is spawned
+    void start(Reactor& reactor);  // receive events in the reactor
+    void close(void);
+    bool active(void) const { return m_fd >= 0; }
+
+    // track pid and its descendants, incl. ones forked since open()
+    void add(pid_t pid);
+    void clear(void);
+
+    bool owns(pid_t pid);
+    void sync(void) { if (m_fd >= 0) receive(); }  // drain pending events
+    const std::unordered_set<pid_t>& procs(void) const { return m_procs; }
+
+  private:
+    int m_fd = -1;
+    Reactor *m_reactor = nullptr;
+
+    std::unordered_set<pid_t> m_procs;
+    // forks seen while no root is known yet, <child, parent>
+    std::vector<std::pair<pid_t, pid_t>> m_pending;
+    uint64_t& m_events = metrics().counter("proctree.events");  // any process
+
+    void receive(void);
+    void forked(pid_t parent, pid_t child);
+};
+
+#endif  // PROC_TREE_HPP
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "runxdg.hpp"
+#include "reactor.hpp"
+
+#define MAX_EVENTS 16
+
+Reactor::Reactor (void)
+{
+  m_epfd = epoll_create1(EPOLL_CLOEXEC);
+  m_post_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (m_epfd < 0 || m_post_fd < 0) {
+    AGL_FATAL("cannot create reactor (%s)", strerror(errno));
+  }
+
+  sigemptyset(&m_sigmask);
+
+  add_fd(m_post_fd, EPOLLIN, [this](uint32_t events) {
+    uint64_t val;
+    if (read(m_post_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+      AGL_WARN("cannot read eventfd (%s)", strerror(errno));
+    run_posted();
+  });
+}
+
+Reactor::~Reactor (void)
+{
+  for (auto& handler : m_handlers) {
+    if (handler.first != m_post_fd && handler.first != m_signal_fd)
+      epoll_ctl(m_epfd, EPOLL_CTL_DEL, handler.first, NULL);
+  }
+  if (m_signal_fd >= 0)
+    close(m_signal_fd);
+  close(m_post_fd);
+  close(m_epfd);
+}
+
+int Reactor::add_fd (int fd, uint32_t events, FdHandler handler)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+
+  if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    AGL_WARN("cannot watch fd %d (%s)", fd, strerror(errno));
+    return -1;
+  }
+  m_handlers[fd] = std::make_shared<FdHandler>(handler);
+
+  return 0;
+}
+
+int Reactor::modify_fd (int fd, uint32_t events)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+
+  return epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void Reactor::remove_fd (int fd)
+{
+  if (m_handlers.erase(fd))
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void set_timerfd (int fd, uint64_t timeout_ms, bool armed)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (armed) {
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+    if (timeout_ms == 0)
+      its.it_value.tv_nsec = 1;  // zero would disarm
+  }
+
+  // also clears expirations not read yet
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+int Reactor::add_timer (uint64_t timeout_ms, Task handler)
+{
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fd < 0) {
+    AGL_WARN("cannot create timer (%s)", strerror(errno));
+    return -1;
+  }
+
+  set_timerfd(fd, timeout_ms, true);
+
+  add_fd(fd, EPOLLIN, [this, fd, handler](uint32_t events) {
+    cancel_timer(fd);
+    handler();
+  });
+
+  return fd;
+}
+
+int Reactor::create_timer (Task handler)
+{
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fd < 0) {
+    AGL_WARN("cannot create timer (%s)", strerror(errno));
+    return -1;
+  }
+
+  add_fd(fd, EPOLLIN, [fd, handler](uint32_t events) {
+    uint64_t expirations;
+
+    // nothing to read if disarmed in this iteration, after it expired
+    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+      handler();
+  });
+
+  return fd;
+}
+
+void Reactor::arm_timer (int id, uint64_t timeout_ms)
+{
+  if (id >= 0)
+    set_timerfd(id, timeout_ms, true);
+}
+
+void Reactor::disarm_timer (int id)
+{
+  if (id >= 0)
+    set_timerfd(id, 0, false);
+}
+
+void Reactor::cancel_timer (int id)
+{
+  if (id < 0 || !m_handlers.count(id))
+    return;
+
+  remove_fd(id);
+  close(id);
+}
+
+void Reactor::block_signals (const std::vector<int>& signums)
+{
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  for (int signum : signums)
+    sigaddset(&mask, signum);
+
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+    AGL_FATAL("Cannot block signals");
+  }
+}
+
+void Reactor::unblock_signals (void)
+{
+  sigset_t mask;
+
+  sigfillset(&mask);
+  pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+int Reactor::add_signal (int signum, SignalHandler handler)
+{
+  sigaddset(&m_sigmask, signum);
+
+  int fd = signalfd(m_signal_fd, &m_sigmask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (fd < 0) {
+    AGL_WARN("cannot create signalfd (%s)", strerror(errno));
+    return -1;
+  }
+
+  if (m_signal_fd < 0) {
+    m_signal_fd = fd;
+    add_fd(m_signal_fd, EPOLLIN, [this](uint32_t events) {
+      dispatch_signals();
+    });
+  }
+  m_signals[signum] = handler;
+
+  return 0;
+}
+
+void Reactor::dispatch_signals (void)
+{
+  struct signalfd_siginfo info;
+
+  while (read(m_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    auto itr = m_signals.find(info.ssi_signo);
+    if (itr != m_signals.end())
+      itr->second(info);
+  }
+}
+
+void Reactor::post (Task task)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_post_mutex);
+    m_posted.push_back(std::move(task));
+  }
+
+  uint64_t val = 1;
+  if (write(m_post_fd, &val, sizeof(val)) < 0)
+    AGL_WARN("cannot wake up reactor (%s)", strerror(errno));
+}
+
+void Reactor::run_posted (void)
+{
+  // both vectors keep their capacity, no allocation in steady state
+  {
+    std::lock_guard<std::mutex> lock(m_post_mutex);
+    m_running.swap(m_posted);
+  }
+
+  for (auto& task : m_running)
+    task();
+  m_running.clear();
+}
+
+void Reactor::run (void)
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  // tasks posted before the loop started
+  run_posted();
+  flush();
+
+  while (!m_quit) {
+    int n = epoll_wait(m_epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      AGL_WARN("epoll_wait failed (%s)", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < n && !m_quit; ++i) {
+      // handler may be removed by a former one in this iteration
+      auto itr = m_handlers.find(events[i].data.fd);
+      if (itr == m_handlers.end())
+        continue;
+
+      std::shared_ptr<FdHandler> handler = itr->second;
+      (*handler)(events[i].events);
+    }
+
+    flush();
+  }
+}
+
+void Reactor::flush (void)
+{
+  for (auto& handler : m_flush_handlers)
+    handler();
+}
+
+void Reactor::quit (void)
+{
+  m_quit = true;
+}
+
+uint64_t Reactor::now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <stdint.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Single threaded event loop over epoll.
+ * Every handler runs on the thread calling run(), other threads hand
+ * work over with post().
+ */
+class Reactor
+{
+  public:
+    typedef std::function<void(void)> Task;
+    typedef std::function<void(uint32_t events)> FdHandler;
+    typedef std::function<void(const struct signalfd_siginfo& info)>
+        SignalHandler;
+
+    Reactor(void);
+    ~Reactor(void);
+
+    int add_fd(int fd, uint32_t events, FdHandler handler);
+    int modify_fd(int fd, uint32_t events);
+    void remove_fd(int fd);
+
+    // one-shot timer, returns id for cancel_timer()
+    int add_timer(uint64_t timeout_ms, Task handler);
+    void cancel_timer(int id);
+
+    // Timer for repeated use, removed by cancel_timer(). Arming it
+    // allocates nothing, the handler runs once per arm_timer() unless
+    // disarmed or armed again before.
+    int create_timer(Task handler);
+    void arm_timer(int id, uint64_t timeout_ms);
+    void disarm_timer(int id);
+
+    // signals must be blocked by block_signals() before any thread starts
+    int add_signal(int signum, SignalHandler handler);
+    static void block_signals(const std::vector<int>& signums);
+    static void unblock_signals(void);
+
+    void post(Task task);  // thread safe
+
+    // called at the end of every loop iteration, to flush batched work
+    void add_flush_handler(Task handler) {
+      m_flush_handlers.push_back(handler);
+    }
+
+    void run(void);
+    void quit(void);
+
+    static uint64_t now_us(void);  // monotonic clock
+
+  private:
+    int m_epfd;
+    int m_post_fd;
+    int m_signal_fd = -1;
+    sigset_t m_sigmask;
+    bool m_quit = false;
+
+    std::map<int, std::shared_ptr<FdHandler>> m_handlers;
+    std::map<int, SignalHandler> m_signals;
+
+    std::vector<Task> m_flush_handlers;
+
+    std::mutex m_post_mutex;
+    std::vector<Task> m_posted;
+    std::vector<Task> m_running;  // being run by run_posted()
+
+    void run_posted(void);
+    void flush(void);
+    void dispatch_signals(void);
+};
+
+#endif  // REACTOR_HPP
@@ -24,12 +24,17 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <dirent.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 
 #include <algorithm>
 #include <cstdio>
+#include <fstream>
 
 #include "cpptoml/cpptoml.h"
 
@@ -37,6 +42,20 @@
 
 #define RUNXDG_CONFIG "runxdg.toml"
 
+// keys of the windowmanager API
+static const char kKeyDrawingName[] = "drawing_name";
+static const char kKeyDrawingArea[] = "drawing_area";
+static const char kKeyIviId[] = "ivi_id";
+
+// events of the windowmanager API, wm_subscribe takes their index
+static const char *const kWMEvents[] = {
+  "active", "inactive", "visible", "invisible", "syncdraw", "flushdraw",
+};
+
+// ilm_surfaceAddNotification() takes no user data, read by the
+// ilmControl thread
+static std::atomic<RunXDG*> g_frame_watcher{nullptr};
+
 void fatal(const char* format, ...)
 {
   va_list va_args;
@@ -67,27 +86,35 @@ void RunXDG::notify_ivi_control_cb (ilmObjectType object, t_ilm_uint id,
                                     t_ilm_bool created)
 {
   if (object == ILM_SURFACE) {
-    struct ilmSurfaceProperties surf_props;
-
-    ilm_getPropertiesOfSurface(id, &surf_props);
-    pid_t surf_pid = surf_props.creatorPid;
-
     if (!created) {
-      AGL_DEBUG("ivi surface (id=%d, pid=%d) destroyed.", id, surf_pid);
-      m_launcher->unregister_surfpid(surf_pid);
-      m_surfaces.erase(surf_pid);
+      if (m_shared) {
+        pid_t owner = m_shared->remove_surface(id);
+        if (owner > 0 && owner != getpid())
+          m_shared->send(owner, SharedRegistry::Event::EVENT_DESTROYED, id,
+                         0, nullptr);
+      }
+      surface_destroyed(id);
+      return;
+    }
+
+    if (defer_surfaces()) {
+      AGL_DEBUG("ivi surface (id=%d) is created.", id);
+      m_unresolved.insert(id);
+      metrics().counter("ilm.props.deferred")++;
       return;
     }
 
-    AGL_DEBUG("ivi surface (id=%d, pid=%d) is created.", id, surf_pid);
+    const SurfaceRegistry::Surface *surface = resolve_surface(id);
+    if (!surface)
+      return;
 
-    m_launcher->register_surfpid(surf_pid);
-    if (m_launcher->m_rid &&
-        surf_pid == m_launcher->find_surfpid_by_rid(m_launcher->m_rid)) {
-      m_ivi_id = id;
-      setup_surface();
+    AGL_DEBUG("ivi surface (id=%d, pid=%d) is created.", id, surface->pid);
+
+    if (m_shared) {
+      broker_surface(*surface);
+      return;
     }
-    m_surfaces[surf_pid] = id;
+    classify_surface(*surface);
   } else if (object == ILM_LAYER) {
     if (created)
       AGL_DEBUG("ivi layer: %d created.", id);
@@ -96,17 +123,410 @@ void RunXDG::notify_ivi_control_cb (ilmObjectType object, t_ilm_uint id,
   }
 }
 
+void RunXDG::surface_destroyed (t_ilm_surface id)
+{
+  // the surface is gone, its creator is known from the cache
+  SurfaceRegistry::Surface surface;
+  if (m_unresolved.erase(id)) {
+    AGL_DEBUG("ivi surface (id=%d) destroyed.", id);
+  } else if (m_surfaces.remove(id, &surface)) {
+    metrics().counter("ilm.props.hit")++;
+    AGL_DEBUG("ivi surface (id=%d, pid=%d) destroyed.", id, surface.pid);
+    if (!m_surfaces.find_by_pid(surface.pid))
+      m_pidns.forget(surface.pid);
+  }
+  if (id == m_ivi_id)
+    m_ivi_id = 0;
+  else
+    m_secondaries.erase(id);
+
+  // nothing more to wait for
+  if (m_frames.erase(id)) {
+    for (size_t i = 0; i < m_draws.size(); ) {
+      if (m_draws[i].id == id)
+        end_draw(i);
+      else
+        ++i;
+    }
+  }
+}
+
+void RunXDG::broker_surface (const SurfaceRegistry::Surface& surface)
+{
+  pid_t owner = m_shared->find_owner(surface.pid);
+  m_shared->publish_surface(surface.id, surface.pid, owner);
+  metrics().counter("shared.resolved")++;
+
+  if (owner == getpid()) {
+    classify_surface(surface);
+  } else if (owner > 0) {
+    m_shared->send(owner, SharedRegistry::Event::EVENT_CREATED, surface.id,
+                   surface.pid, &surface.props);
+  }
+}
+
+void RunXDG::shared_event (const SharedRegistry::Event& event)
+{
+  switch (event.type) {
+    case SharedRegistry::Event::EVENT_CREATED:
+      AGL_DEBUG("ivi surface (id=%d, pid=%d) is created (broker).",
+                event.id, event.creator);
+      m_surfaces.add(event.id, event.props, getpgid(event.creator));
+      classify_surface(*m_surfaces.find(event.id));
+      break;
+
+    case SharedRegistry::Event::EVENT_DESTROYED:
+      surface_destroyed(event.id);
+      break;
+
+    case SharedRegistry::Event::EVENT_TAP:
+      m_tap_wakeups++;
+      route_tap(m_role);
+      break;
+
+    case SharedRegistry::Event::EVENT_SLOT:
+      // an app has (re)started, hand over its surfaces known already
+      if (!m_shared->broker())
+        break;
+      for (t_ilm_surface id : m_shared->adoptable_surfaces(event.sender)) {
+        // taken over from the previous broker, not queried yet
+        const SurfaceRegistry::Surface *surface = m_surfaces.find(id);
+        if (!surface)
+          surface = resolve_surface(id);
+        if (surface)
+          broker_surface(*surface);
+      }
+      break;
+  }
+}
+
+void RunXDG::route_tap (const std::string& name)
+{
+  if (name == m_role) {
+    // check app exist and re-launch if needed
+    AGL_DEBUG("Activesurface %s ", m_role.c_str());
+    m_taps_handled++;
+
+    // The app may be still starting, don't lose the tap
+    if (m_ivi_id)
+      m_tap.request(true);
+    else
+      queue_intent(Intent::INTENT_ACTIVATE, "normal.full", false);
+    return;
+  }
+
+  if (!m_shared)
+    return;
+
+  pid_t instance = m_shared->find_role(name);
+  if (instance > 0 &&
+      m_shared->send(instance, SharedRegistry::Event::EVENT_TAP, 0, 0,
+                     nullptr) == 0) {
+    m_taps_routed++;
+  }
+}
+
+void RunXDG::setup_shared (void)
+{
+  m_shared = new SharedRegistry(m_reactor, m_shared_path, m_role);
+
+  m_shared->m_on_broker = [this]() {
+    // only the broker listens to the compositor and HomeScreen
+    m_ic->subscribe(notify_ivi_control_cb_static, this);
+    sync_surfaces();
+    if (m_afb.connected())
+      hs_subscribe("tap_shortcut");
+  };
+  m_shared->m_on_event = [this](const SharedRegistry::Event& event) {
+    shared_event(event);
+  };
+
+  if (m_shared->open()) {
+    AGL_WARN("cannot share surfaces with other instances");
+    delete m_shared;
+    m_shared = nullptr;
+  }
+}
+
+void ILMControl::flush (void)
+{
+  if (!m_dirty && m_focus[0].empty() && m_focus[1].empty())
+    return;
+
+  for (int set = 0; set < 2; ++set) {
+    if (!m_focus[set].empty()) {
+      ilm_setInputFocus(m_focus[set].data(), m_focus[set].size(),
+                        ILM_INPUT_DEVICE_KEYBOARD, set ? ILM_TRUE : ILM_FALSE);
+      m_focus[set].clear();
+    }
+  }
+
+  ilm_commitChanges();
+  m_dirty = false;
+  m_commits++;
+}
+
 void RunXDG::notify_ivi_control_cb_static (ilmObjectType object, t_ilm_uint id,
                                            t_ilm_bool created, void *user_data)
 {
+  // Called on the ilmControl thread, hand over to the reactor.
+  // No compositor round trip and no lock here.
   RunXDG *runxdg = static_cast<RunXDG*>(user_data);
-  runxdg->notify_ivi_control_cb(object, id, created);
+  ILMNotification notification = { object, id, created, Reactor::now_us(),
+                                   false, 0, 0, 0 };
+
+  runxdg->push_ilm_notification(notification);
+}
+
+void RunXDG::notify_surface_cb_static (t_ilm_surface id,
+                                       struct ilmSurfaceProperties *props,
+                                       t_ilm_notification_mask mask)
+{
+  // Same thread as notify_ivi_control_cb_static(), the queue keeps a
+  // single producer.
+  ILMNotification notification = { ILM_SURFACE, id, ILM_TRUE,
+                                   Reactor::now_us(), true,
+                                   props->frameCounter,
+                                   props->origSourceWidth,
+                                   props->origSourceHeight };
+
+  RunXDG *runxdg = g_frame_watcher.load();
+  if (runxdg)
+    runxdg->push_ilm_notification(notification);
+}
+
+void RunXDG::push_ilm_notification (const ILMNotification& notification)
+{
+  if (!m_ilm_queue.push(notification)) {
+    m_ilm_overflow++;
+    AGL_WARN("ilm notification queue overflow, drop (id=%d)",
+             notification.id);
+    return;
+  }
+
+  // Wake up the reactor only once until it drains the queue
+  if (!m_ilm_wakeup.exchange(true)) {
+    uint64_t val = 1;
+    if (write(m_ilm_fd, &val, sizeof(val)) < 0)
+      AGL_WARN("cannot wake up reactor (%s)", strerror(errno));
+  }
+}
+
+void RunXDG::process_ilm_queue (void)
+{
+  ILMNotification notification;
+  uint64_t val;
+
+  if (read(m_ilm_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+    AGL_WARN("cannot read eventfd (%s)", strerror(errno));
+
+  // Clear before draining, a push racing with us wakes us up again
+  m_ilm_wakeup.store(false);
+
+  m_ilm_depth.add(m_ilm_queue.size());
+
+  while (m_ilm_queue.pop(notification)) {
+    if (notification.frame) {
+      Frame frame = { notification.frame_counter, notification.width,
+                      notification.height };
+      frame_committed(notification.id, frame);
+    } else {
+      notify_ivi_control_cb(notification.object, notification.id,
+                            notification.created);
+    }
+    m_ilm_latency.add(Reactor::now_us() - notification.stamp);
+  }
+
+  // Notifications were dropped, the registry can't be trusted anymore
+  uint64_t overflow = m_ilm_overflow.load();
+  if (overflow != m_ilm_synced_overflow) {
+    m_ilm_synced_overflow = overflow;
+    AGL_WARN("ilm notifications lost, resync surfaces");
+    sync_surfaces();
+
+    if (m_ivi_id && !m_surfaces.find(m_ivi_id))
+      m_ivi_id = 0;
+    for (auto itr = m_secondaries.begin(); itr != m_secondaries.end(); ) {
+      if (m_surfaces.find(itr->first))
+        ++itr;
+      else
+        m_secondaries.erase(itr++);
+    }
+    if (!m_ivi_id &&
+        m_lifecycle.state() == Lifecycle::STATE_WAITING_SURFACE)
+      attach_app_surface();
+  }
+}
+
+void RunXDG::sync_surfaces (void)
+{
+  uint64_t start = Reactor::now_us();
+  t_ilm_int count = 0;
+  t_ilm_surface *ids = NULL;
+
+  if (ilm_getSurfaceIDs(&count, &ids) != ILM_SUCCESS) {
+    AGL_WARN("cannot get ivi surfaces");
+    return;
+  }
+
+  // destroyed while no broker listened, or while notifications were lost
+  if (m_shared) {
+    for (const auto& gone : m_shared->retain_surfaces(ids, count)) {
+      if (gone.second == getpid())
+        surface_destroyed(gone.first);
+      else if (gone.second > 0)
+        m_shared->send(gone.second, SharedRegistry::Event::EVENT_DESTROYED,
+                       gone.first, 0, nullptr);
+    }
+  }
+
+  // Only at startup or after lost notifications, fill the whole cache.
+  // ilm has no batch query: each surface costs one property round trip
+  // to the compositor, all of them are in ilm.sync_us. Before the app
+  // is launched, they are deferred like notified surfaces.
+  m_surfaces.clear();
+  m_unresolved.clear();
+  bool defer = defer_surfaces();
+  for (t_ilm_int i = 0; i < count; ++i) {
+    if (defer) {
+      m_unresolved.insert(ids[i]);
+      metrics().counter("ilm.props.deferred")++;
+      continue;
+    }
+
+    // Published by a previous broker, owners know theirs already. Ours
+    // are resolved again, the cache has just been cleared.
+    if (m_shared) {
+      pid_t owner = m_shared->published(ids[i]);
+      if (owner == 0 ||
+          (owner > 0 && owner != getpid() && kill(owner, 0) == 0)) {
+        metrics().counter("shared.taken_over")++;
+        continue;
+      }
+    }
+
+    const SurfaceRegistry::Surface *surface = resolve_surface(ids[i]);
+    if (surface && m_shared)
+      broker_surface(*surface);
+  }
+  free(ids);
+
+  AGL_DEBUG("%d ivi surface(s) exist", count);
+  metrics().counter("ilm.syncs")++;
+  metrics().sample("ilm.sync_us", Reactor::now_us() - start);
+}
+
+bool RunXDG::defer_surfaces (void)
+{
+  // Querying properties is a round trip to the compositor, don't for
+  // a surface which can't belong to the app. The broker resolves every
+  // surface, once for all instances.
+  return !m_shared && (!m_launcher->m_rid ||
+                       m_lifecycle.state() == Lifecycle::STATE_EXITING);
+}
+
+const SurfaceRegistry::Surface* RunXDG::resolve_surface (t_ilm_surface id)
+{
+  struct ilmSurfaceProperties surf_props;
+
+  metrics().counter("ilm.props.miss")++;
+  if (ilm_getPropertiesOfSurface(id, &surf_props) != ILM_SUCCESS) {
+    AGL_DEBUG("cannot get properties of ivi surface (id=%d)", id);
+    return nullptr;
+  }
+
+  pid_t surf_pid = surf_props.creatorPid;
+  m_surfaces.add(id, surf_props, getpgid(surf_pid));
+  return m_surfaces.find(id);
+}
+
+void RunXDG::attach_app_surface (void)
+{
+  if (!m_launcher->m_rid)
+    return;
+
+  // Surfaces created while no app could own them. A spawned app can't
+  // own any of them, they are never queried; one started by afm may
+  // have been running already.
+  if (m_launcher->spawns()) {
+    metrics().counter("ilm.props.skipped") += m_unresolved.size();
+  } else {
+    for (t_ilm_surface id : m_unresolved)
+      resolve_surface(id);
+  }
+  m_unresolved.clear();
+
+  // the app leads its process group, for both POSIX and afm
+  t_ilm_surface id = 0;
+  if (m_launcher->local_rid() > 0)
+    id = m_surfaces.find_by_pgid(m_launcher->local_rid());
+  if (id) {
+    AGL_DEBUG("surface %d for <%s> already exists", id, m_role.c_str());
+    classify_surface(*m_surfaces.find(id));
+  }
+}
+
+void RunXDG::export_stats (void)
+{
+  metrics().set("ilm.queue_overflow", m_ilm_overflow.load());
+  // taps this instance was woken up by, vs. hs.tap.handled for its role
+  metrics().set("hs.tap.wakeups", m_tap_wakeups.load());
+
+  // rate of compositor commits since the last export
+  uint64_t now = Reactor::now_us();
+  uint64_t commits = metrics().counter("ilm.commits");
+  if (m_stats_time && now > m_stats_time) {
+    metrics().set("ilm.commits_per_sec",
+                  (commits - m_stats_commits) * 1000 * 1000 /
+                  (now - m_stats_time));
+  }
+  m_stats_time = now;
+  m_stats_commits = commits;
+
+  if (!m_stats_path.empty())
+    metrics().write_file(m_stats_path);
+}
+
+void RunXDG::setup_stats (void)
+{
+  m_reactor.add_signal(SIGUSR1, [this](const struct signalfd_siginfo& info) {
+    export_stats();
+    AGL_DEBUG("stats:\n%s", metrics().dump().c_str());
+  });
+
+  if (!m_stats_path.empty() && m_stats_interval)
+    arm_stats_timer();
+}
+
+void RunXDG::arm_stats_timer (void)
+{
+  m_reactor.add_timer(m_stats_interval, [this]() {
+    export_stats();
+    arm_stats_timer();
+  });
 }
 
 int POSIXLauncher::launch (std::string& name)
 {
   pid_t pid;
 
+  // Become a subreaper so that daemonized descendants of the app are
+  // reparented to runxdg instead of init, and can be tracked and reaped.
+  if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+    AGL_WARN("cannot set child subreaper (%s)", strerror(errno));
+  }
+
+  // subscribe before fork(), not to miss early children of the app
+  if (m_tree.open() == 0)
+    m_tree.clear();
+
+  if (m_log && m_log->setup()) {
+    AGL_WARN("cannot capture app log, inherit stdout/stderr");
+    delete m_log;
+    m_log = nullptr;
+  }
+
+  pid_t parent = getpid();
   pid = fork();
   if (pid < 0) {
     AGL_DEBUG("cannot fork()");
@@ -115,6 +535,19 @@ int POSIXLauncher::launch (std::string& name)
 
   if (pid == 0) {
     // child
+    Reactor::unblock_signals();
+
+    // own process group, so that it can be signaled without runxdg
+    setpgid(0, 0);
+
+    // Out of the group of runxdg, the app is not signaled with it: have
+    // it killed when runxdg dies, and not started if runxdg is gone.
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL) < 0 || getppid() != parent)
+      _exit(1);
+
+    if (m_log)
+      m_log->setup_child();
+
     const char **argv = new const char * [m_args_v.size() + 1];
     for (unsigned int i = 0; i < m_args_v.size(); ++i) {
       argv[i] = m_args_v[i].c_str();
@@ -126,27 +559,101 @@ int POSIXLauncher::launch (std::string& name)
     AGL_FATAL("fail to execve(%s)", argv[0]);
   }
   // parent
+  setpgid(pid, pid);  // no race with the child's own setpgid()
+  m_procs.insert(pid);
+  if (m_tree.active())
+    m_tree.add(pid);
 
   return pid;
 }
 
-void POSIXLauncher::loop (volatile sig_atomic_t& e_flag)
+static void read_children (pid_t pid, std::vector<pid_t>& children)
+{
+  std::string task_dir = "/proc/" + std::to_string(pid) + "/task";
+  DIR *dir = opendir(task_dir.c_str());
+  if (dir == NULL)
+    return;
+
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] == '.')
+      continue;
+
+    std::ifstream ifs(task_dir + "/" + ent->d_name + "/children");
+    pid_t child;
+    while (ifs >> child) {
+      children.push_back(child);
+    }
+  }
+  closedir(dir);
+}
+
+void POSIXLauncher::update_procs (void)
+{
+  if (m_tree.active()) {
+    m_tree.sync();
+    m_procs = std::set<pid_t>(m_tree.procs().begin(), m_tree.procs().end());
+    AGL_DEBUG("app has %zu live process(es)", m_procs.size());
+    return;
+  }
+
+  // All children of runxdg belong to the app: the app itself and
+  // any orphaned descendants reparented to us as subreaper.
+  std::vector<pid_t> queue;
+  read_children(getpid(), queue);
+
+  std::set<pid_t> procs;
+  while (!queue.empty()) {
+    pid_t pid = queue.back();
+    queue.pop_back();
+    if (procs.insert(pid).second) {
+      read_children(pid, queue);
+    }
+  }
+
+  m_procs.swap(procs);
+  AGL_DEBUG("app has %zu live process(es)", m_procs.size());
+}
+
+bool POSIXLauncher::owns (pid_t pid)
+{
+  if (m_rid <= 0)
+    return false;
+  if (pid == m_rid)
+    return true;
+
+  if (m_tree.active())
+    return m_tree.owns(pid);
+
+  // no proc connector, look for it in /proc
+  update_procs();
+  return m_procs.count(pid);
+}
+
+void POSIXLauncher::kill_procs (int signum)
+{
+  update_procs();
+  for (pid_t pid : m_procs) {
+    AGL_DEBUG("kill(%d, %d)", pid, signum);
+    ::kill(pid, signum);
+  }
+}
+
+void POSIXLauncher::reap (void)
 {
   int status;
   pid_t ret;
 
-  while (!e_flag) {
-    ret = waitpid(m_rid, &status, 0);
-    if (ret < 0) {
-      if (errno == EINTR) {
-        AGL_DEBUG("catch EINTR while waitpid()");
-        continue;
-      }
-      break;
+  // Reap every child, not only m_rid, so that orphaned descendants
+  // don't stay as zombies.
+  while ((ret = waitpid(-1, &status, WNOHANG)) > 0) {
+    m_procs.erase(ret);
+
+    if (ret != m_rid) {
+      AGL_DEBUG("descendant (pid=%d) reaped", ret);
+      continue;
     }
-  }
 
-  if (ret > 0) {
     if (WIFEXITED(status)) {
       AGL_DEBUG("%s terminated, return %d", m_args_v[0].c_str(),
                 WEXITSTATUS(status));
@@ -155,13 +662,81 @@ void POSIXLauncher::loop (volatile sig_atomic_t& e_flag)
       AGL_DEBUG("%s terminated by signal %d", m_args_v[0].c_str(),
                 WTERMSIG(status));
     }
+
+    m_rid_exited = true;
+    if (m_pidfd >= 0) {
+      m_reactor->remove_fd(m_pidfd);
+      close(m_pidfd);
+      m_pidfd = -1;
+    }
+
+    if (m_on_exiting)
+      m_on_exiting();
+
+    // Terminate helpers left behind by the app (incl. ones out of its pgrp)
+    kill_procs(SIGTERM);
+  }
+
+  if (ret < 0 && errno == ECHILD && (m_rid_exited || m_terminating)) {
+    // No child left at all
+    if (m_log)
+      m_log->stop();
+
+    m_rid_exited = false;
+    m_terminating = false;
+
+    if (m_on_exit)
+      m_on_exit();
   }
+}
 
-  if (e_flag) {
-    /* parent killed by someone, so need to kill children */
-    AGL_DEBUG("killpg(0, SIGTERM)");
-    killpg(0, SIGTERM);
+void POSIXLauncher::watch (Reactor& reactor)
+{
+  m_reactor = &reactor;
+
+  m_reactor->add_signal(SIGCHLD, [this](const struct signalfd_siginfo& info) {
+    reap();
+  });
+
+#ifdef SYS_pidfd_open
+  m_pidfd = syscall(SYS_pidfd_open, m_rid, 0);
+#endif
+  if (m_pidfd >= 0) {
+    m_reactor->add_fd(m_pidfd, EPOLLIN, [this](uint32_t events) {
+      reap();
+    });
+  } else {
+    AGL_DEBUG("pidfd is not available, rely on SIGCHLD");
   }
+
+  m_tree.start(reactor);
+
+  if (m_log)
+    m_log->start(reactor);
+
+  // in case the app has already exited
+  reap();
+}
+
+void POSIXLauncher::terminate (void)
+{
+  if (m_terminating)
+    return;
+  m_terminating = true;
+
+  AGL_DEBUG("killpg(%d, SIGTERM)", m_rid);
+  killpg(m_rid, SIGTERM);
+
+  kill_procs(SIGTERM);
+  reap();
+}
+
+void POSIXLauncher::kill_all (void)
+{
+  AGL_DEBUG("killpg(%d, SIGKILL)", m_rid);
+  killpg(m_rid, SIGKILL);
+
+  kill_procs(SIGKILL);
 }
 
 int AFMDBusLauncher::get_dbus_message_bus (GBusType bus_type,
@@ -189,6 +764,10 @@ int AFMDBusLauncher::launch (std::string &name)
   char*               val;
   const char*         xdg_app = name.c_str();
 
+  // afm forks the app, record the forks until its rid is known
+  if (m_tree.open() == 0)
+    m_tree.clear();
+
   if (get_dbus_message_bus(G_BUS_TYPE_SESSION, conn)) {
     return -1;
   }
@@ -242,134 +821,302 @@ int AFMDBusLauncher::launch (std::string &name)
   return rid;
 }
 
-volatile sig_atomic_t e_flag = 0;
+struct StateQuery {
+  AFMDBusLauncher *launcher;
+  pid_t rid;
+};
 
-static void sigterm_handler (int signum)
+void AFMDBusLauncher::query_state (pid_t rid)
 {
-  e_flag = 1;
+  // Sent from the GMainLoop thread, the reply is handled there too and
+  // only its result goes to the reactor.
+  std::string arg = std::to_string(rid);
+  g_dbus_connection_call(
+      m_conn, DBUS_SERVICE, DBUS_PATH, DBUS_INTERFACE, "state",
+      g_variant_new("(s)", arg.c_str()), G_VARIANT_TYPE("(s)"),
+      G_DBUS_CALL_FLAGS_NONE, -1, NULL, on_state, new StateQuery{this, rid});
 }
 
-static void init_signal (void)
+void AFMDBusLauncher::on_state (GObject *source, GAsyncResult *result,
+                                gpointer user_data)
 {
-  struct sigaction act, info;
-
-  /* Setup signal for SIGTERM */
-  if (!sigaction(SIGTERM, NULL, &info)) {
-    if (info.sa_handler == SIG_IGN) {
-      AGL_DEBUG("SIGTERM being ignored.");
-    } else if (info.sa_handler == SIG_DFL) {
-      AGL_DEBUG("SIGTERM being defaulted.");
-    }
-  }
+  StateQuery *query = static_cast<StateQuery*>(user_data);
+  AFMDBusLauncher *launcher = query->launcher;
+  pid_t rid = query->rid;
+  GError* err = NULL;
+  const char* val;
+  bool running = false;
+  delete query;
 
-  act.sa_handler = &sigterm_handler;
-  if (sigemptyset(&act.sa_mask) != 0) {
-    AGL_FATAL("Cannot initialize sigaction");
+  GVariant *ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source),
+                                                result, &err);
+  if (err != NULL) {
+    // afm replies an error once the runid has gone
+    AGL_DEBUG("state(%d) failed: %s", rid, err->message);
+    g_clear_error(&err);
+  } else {
+    g_variant_get(ret, "(&s)", &val);
+    AGL_DEBUG("state of rid(%d): %s", rid, val);
+    running = strstr(val, "\"terminated\"") == NULL;
+    g_variant_unref(ret);
   }
-  act.sa_flags = 0;
 
-  if (sigaction(SIGTERM, &act, &info) != 0) {
-    AGL_FATAL("Cannot register signal handler for SIGTERM");
-  }
+  if (running)
+    return;
+  launcher->m_reactor->post([launcher, rid]() {
+    if (launcher->m_rid == rid)
+      launcher->exited();
+  });
 }
 
-int RunXDG::init_wm (void)
+gboolean AFMDBusLauncher::check_state (gpointer user_data)
 {
-  m_wm = new LibWindowmanager();
-  if (m_wm->init(m_port, m_token.c_str())) {
-    AGL_DEBUG("cannot initialize windowmanager");
-    return -1;
-  }
+  AFMDBusLauncher *launcher = static_cast<AFMDBusLauncher*>(user_data);
+  pid_t rid = launcher->m_watched_rid.load();
 
-  std::function< void(json_object*) > h_active = [this](json_object* object) {
-    AGL_DEBUG("Got Event_Active");
-    t_ilm_surface s_ids[1] = { this->m_ivi_id };
-    ilm_setInputFocus(s_ids, 1, ILM_INPUT_DEVICE_KEYBOARD, ILM_TRUE);
-  };
+  if (rid > 0)
+    launcher->query_state(rid);
+  return G_SOURCE_REMOVE;
+}
 
-  std::function< void(json_object*) > h_inactive = [this](json_object* object) {
-    AGL_DEBUG("Got Event_Inactive");
-    t_ilm_surface s_ids[1] = { this->m_ivi_id };
-    ilm_setInputFocus(s_ids, 1, ILM_INPUT_DEVICE_KEYBOARD, ILM_FALSE);
-  };
+void AFMDBusLauncher::on_changed (GDBusConnection *conn, const gchar *sender,
+                                  const gchar *path, const gchar *interface,
+                                  const gchar *signal, GVariant *params,
+                                  gpointer user_data)
+{
+  // Called in the GMainLoop thread for a change of any app, only one
+  // of ours is checked (a round trip to afm, not waited for).
+  AFMDBusLauncher *launcher = static_cast<AFMDBusLauncher*>(user_data);
+  pid_t rid = launcher->m_watched_rid.load();
+  if (rid <= 0)
+    return;
 
-  std::function< void(json_object*) > h_visible = [](json_object* object) {
-    AGL_DEBUG("Got Event_Visible");
-  };
+  pid_t changed = signal_runid(params);
+  if (changed > 0 && changed != rid)
+    return;
 
-  std::function< void(json_object*) > h_invisible = [](json_object* object) {
-    AGL_DEBUG("Got Event_Invisible");
-  };
+  launcher->query_state(rid);
+}
 
-  std::function< void(json_object*) > h_syncdraw =
-      [this](json_object* object) {
-    AGL_DEBUG("Got Event_SyncDraw");
-    json_object* obj = json_object_new_object();
-    json_object_object_add(obj, this->m_wm->kKeyDrawingName,
-                           json_object_new_string(this->m_role.c_str()));
-    this->m_wm->endDraw(obj);
-  };
+pid_t AFMDBusLauncher::signal_runid (GVariant *params)
+{
+  const gchar *str = nullptr;
+  json_object *obj, *data, *val;
+  pid_t rid = 0;
 
-  std::function< void(json_object*) > h_flushdraw= [](json_object* object) {
-    AGL_DEBUG("Got Event_FlushDraw");
-  };
+  // ("{"runid": n, ...}"), the runid may be in "data"; 0 if unknown
+  if (!g_variant_is_of_type(params, G_VARIANT_TYPE("(s)")))
+    return 0;
+  g_variant_get(params, "(&s)", &str);
 
-  m_wm->set_event_handler(LibWindowmanager::Event_Active, h_active);
-  m_wm->set_event_handler(LibWindowmanager::Event_Inactive, h_inactive);
-  m_wm->set_event_handler(LibWindowmanager::Event_Visible, h_visible);
-  m_wm->set_event_handler(LibWindowmanager::Event_Invisible, h_invisible);
-  m_wm->set_event_handler(LibWindowmanager::Event_SyncDraw, h_syncdraw);
-  m_wm->set_event_handler(LibWindowmanager::Event_FlushDraw, h_flushdraw);
+  obj = json_tokener_parse(str);
+  if (!obj)
+    return 0;
+  if (json_object_object_get_ex(obj, "data", &data) &&
+      json_object_is_type(data, json_type_object)) {
+    if (json_object_object_get_ex(data, "runid", &val))
+      rid = json_object_get_int(val);
+  } else if (json_object_object_get_ex(obj, "runid", &val)) {
+    rid = json_object_get_int(val);
+  }
+  json_object_put(obj);
 
-  return 0;
+  return rid;
 }
 
-int RunXDG::init_hs (void)
+void AFMDBusLauncher::run_main_loop (void)
 {
-  m_hs = new LibHomeScreen();
-  if (m_hs->init(m_port, m_token.c_str())) {
-    AGL_DEBUG("cannot initialize homescreen");
-    return -1;
-  }
-
-  std::function< void(json_object*) > handler = [this] (json_object* object) {
-    json_object *val;
+  g_main_context_push_thread_default(m_context);
 
-    if (json_object_object_get_ex(object, "application_name", &val)) {
-      const char *name = json_object_get_string(val);
+  guint id = g_dbus_connection_signal_subscribe(
+      m_conn, DBUS_SERVICE, DBUS_INTERFACE, "changed", DBUS_PATH, NULL,
+      G_DBUS_SIGNAL_FLAGS_NONE, on_changed, this, NULL);
 
-      AGL_DEBUG("Event_TapShortcut <%s>", name);
+  g_main_loop_run(m_loop);
 
-      if (strcmp(name, this->m_role.c_str()) == 0) {
-        // check app exist and re-launch if needed
-        AGL_DEBUG("Activesurface %s ", this->m_role.c_str());
+  g_dbus_connection_signal_unsubscribe(m_conn, id);
+  g_main_context_pop_thread_default(m_context);
+}
 
-        json_object *obj = json_object_new_object();
-        json_object_object_add(obj, this->m_wm->kKeyDrawingName,
-                               json_object_new_string(this->m_role.c_str()));
-        json_object_object_add(obj, this->m_wm->kKeyDrawingArea,
-                               json_object_new_string("normal.full"));
+void AFMDBusLauncher::watch (Reactor& reactor)
+{
+  AFMLauncher::watch(reactor);
 
-        this->m_wm->activateSurface(obj);
-      }
-    }
-  };
-  m_hs->set_event_handler(LibHomeScreen::Event_TapShortcut, handler);
+  // the same connection for every launch
+  if (m_rid <= 0 ||
+      (!m_conn && get_dbus_message_bus(G_BUS_TYPE_SESSION, m_conn)))
+    return;
+  m_watched_rid.store(m_rid);
 
-  std::function< void(json_object*) > h_default= [](json_object* object) {
-    const char *j_str = json_object_to_json_string(object);
-    AGL_DEBUG("Got event [%s]", j_str);
-  };
-  m_hs->set_event_handler(LibHomeScreen::Event_OnScreenMessage, h_default);
+  // Signals of afm are delivered to its own GMainContext in a thread
+  if (!m_thread.joinable()) {
+    m_context = g_main_context_new();
+    m_loop = g_main_loop_new(m_context, FALSE);
+    m_thread = std::thread(&AFMDBusLauncher::run_main_loop, this);
+  }
 
-  return 0;
+  // In case the app has gone before the subscription, checked by the
+  // GMainLoop thread, never run here as g_main_context_invoke() may.
+  GSource *source = g_idle_source_new();
+  g_source_set_callback(source, check_state, this, NULL);
+  g_source_attach(source, m_context);
+  g_source_unref(source);
 }
 
-int RunXDG::parse_config (const char *path_to_config)
+void AFMDBusLauncher::terminate (void)
 {
-  auto config = cpptoml::parse_file(path_to_config);
+  if (m_conn && m_rid > 0) {
+    // not waited for, the app is watched until it has exited
+    AGL_DEBUG("terminate rid(%d)", m_rid);
+    std::string arg = std::to_string(m_rid);
+    g_dbus_connection_call(
+        m_conn, DBUS_SERVICE, DBUS_PATH, DBUS_INTERFACE, "terminate",
+        g_variant_new("(s)", arg.c_str()), NULL, G_DBUS_CALL_FLAGS_NONE, -1,
+        NULL, NULL, NULL);
+  }
 
-  if (config == nullptr) {
+  AFMLauncher::terminate();
+}
+
+AFMDBusLauncher::~AFMDBusLauncher (void)
+{
+  if (m_thread.joinable()) {
+    g_main_loop_quit(m_loop);
+    m_thread.join();
+  }
+  if (m_loop)
+    g_main_loop_unref(m_loop);
+  if (m_context)
+    g_main_context_unref(m_context);
+  if (m_conn)
+    g_object_unref(m_conn);
+}
+
+int RunXDG::init_wm (void)
+{
+  build_payloads();
+  m_draws.reserve(m_payloads.size());  // at most one per drawing name
+
+  // Handlers are called in the reactor. Steady state handling doesn't
+  // allocate: payloads are prebuilt and drawing names compared in place.
+  m_afb.set_event_handler("windowmanager/active", [this](json_object* object) {
+    AGL_DEBUG("Got Event_Active");
+    if (!is_main_event(object))
+      return;
+    if (m_ivi_id)
+      m_focus.request(true);
+    else
+      queue_intent(Intent::INTENT_FOCUS, "", true);
+    if (m_lifecycle.state() == Lifecycle::STATE_BACKGROUND)
+      m_lifecycle.enter(Lifecycle::STATE_ACTIVE);
+  });
+
+  m_afb.set_event_handler("windowmanager/inactive",
+                          [this](json_object* object) {
+    AGL_DEBUG("Got Event_Inactive");
+    if (!is_main_event(object))
+      return;
+    if (m_ivi_id)
+      m_focus.request(false);
+    else
+      queue_intent(Intent::INTENT_FOCUS, "", false);
+    if (m_lifecycle.state() == Lifecycle::STATE_ACTIVE)
+      m_lifecycle.enter(Lifecycle::STATE_BACKGROUND);
+  });
+
+  m_afb.set_event_handler("windowmanager/visible", [](json_object* object) {
+    AGL_DEBUG("Got Event_Visible");
+  });
+
+  m_afb.set_event_handler("windowmanager/invisible", [](json_object* object) {
+    AGL_DEBUG("Got Event_Invisible");
+  });
+
+  m_afb.set_event_handler("windowmanager/syncdraw",
+                          [this](json_object* object) {
+    AGL_DEBUG("Got Event_SyncDraw");
+    // each surface of the app registered to WM is drawn on its own
+    const Payloads *payloads = find_payloads(event_role(object));
+    if (payloads)
+      sync_draw(payloads);
+  });
+
+  m_afb.set_event_handler("windowmanager/flushdraw", [](json_object* object) {
+    AGL_DEBUG("Got Event_FlushDraw");
+  });
+
+  return 0;
+}
+
+int RunXDG::subscribe_events (void)
+{
+  // pipelined, nothing waits for the replies
+  int ret = 0;
+  for (size_t i = 0; i < sizeof(kWMEvents) / sizeof(kWMEvents[0]); ++i) {
+    json_object *obj = json_object_new_object();
+    json_object_object_add(obj, "event", json_object_new_int(i));
+    const char *event = kWMEvents[i];
+    ret |= m_afb.call("windowmanager", "wm_subscribe", obj,
+                      [event](bool ok, json_object *reply) {
+      if (!ok)
+        AGL_WARN("cannot subscribe windowmanager/%s", event);
+    });
+  }
+
+  // Every instance would be woken up by every tap, only the broker
+  // subscribes when surfaces are shared.
+  ret |= hs_subscribe("on_screen_message");
+  if (!m_shared || m_shared->broker())
+    ret |= hs_subscribe("tap_shortcut");
+
+  return ret;
+}
+
+int RunXDG::hs_subscribe (const char *event)
+{
+  json_object *obj = json_object_new_object();
+  json_object_object_add(obj, "event", json_object_new_string(event));
+
+  return m_afb.call("homescreen", "subscribe", obj,
+                    [event](bool ok, json_object *reply) {
+    if (!ok)
+      AGL_WARN("cannot subscribe homescreen/%s", event);
+  });
+}
+
+int RunXDG::init_hs (void)
+{
+  m_afb.set_event_handler("homescreen/tap_shortcut",
+                          [this](json_object* object) {
+    json_object *val;
+
+    m_tap_wakeups++;
+    if (!json_object_object_get_ex(object, "application_name", &val))
+      return;
+
+    const char *name = json_object_get_string(val);
+    AGL_DEBUG("Event_TapShortcut <%s>", name);
+
+    if (strcmp(name, m_role.c_str()) == 0)
+      route_tap(m_role);
+    else if (m_shared)
+      route_tap(name);  // the broker routes taps of other roles
+  });
+
+  m_afb.set_event_handler("homescreen/on_screen_message",
+                          [](json_object* object) {
+    const char *j_str = json_object_to_json_string(object);
+    AGL_DEBUG("Got event [%s]", j_str);
+  });
+
+  return 0;
+}
+
+int RunXDG::parse_config (const char *path_to_config)
+{
+  auto config = cpptoml::parse_file(path_to_config);
+
+  if (config == nullptr) {
     AGL_DEBUG("cannot parse %s", path_to_config);
     return -1;
   }
@@ -382,17 +1129,153 @@ int RunXDG::parse_config (const char *path_to_config)
     return -1;
   }
 
-  m_role = *(app->get_as<std::string>("role"));
+  // a service has no surface, thus no role for WM
+  std::string mode = app->get_as<std::string>("mode").value_or("app");
+  if (mode == "service")
+    m_service = true;
+  else if (mode != "app")
+    AGL_FATAL("Unknown mode: %s", mode.c_str());
+
+  m_role = app->get_as<std::string>("role").value_or("");
   m_path = *(app->get_as<std::string>("path"));
-  if (m_role.empty() || m_path.empty()) {
+  if ((m_role.empty() && !m_service) || m_path.empty()) {
     AGL_FATAL("No name or path defined in config");
   }
+  if (m_role.empty())
+    m_role = m_path.substr(m_path.rfind('/') + 1);  // tag of its log
 
   std::string method = *(app->get_as<std::string>("method"));
   if (method.empty()) {
     method = std::string("POSIX");
   }
 
+  // setup export of stats (optional)
+  auto stats = config->get_table("stats");
+  if (stats) {
+    m_stats_path = stats->get_as<std::string>("path").value_or("");
+    m_stats_interval = stats->get_as<int64_t>("interval").value_or(0);
+  }
+
+  // setup deadlines of app lifecycle (msec, 0 to disable)
+  auto lifecycle = config->get_table("lifecycle");
+  struct {
+    const char *key;
+    Lifecycle::State state;
+    int64_t timeout;
+  } deadlines[] = {
+    { "spawn_timeout",    Lifecycle::STATE_SPAWNING,        5000 },
+    { "surface_timeout",  Lifecycle::STATE_WAITING_SURFACE, 30000 },
+    { "register_timeout", Lifecycle::STATE_REGISTERING,     5000 },
+    { "exit_timeout",     Lifecycle::STATE_EXITING,         5000 },
+  };
+  for (auto& deadline : deadlines) {
+    if (lifecycle)
+      deadline.timeout = lifecycle->get_as<int64_t>(deadline.key)
+                             .value_or(deadline.timeout);
+    m_lifecycle.set_deadline(deadline.state, deadline.timeout);
+  }
+  if (lifecycle) {
+    m_recovery = Lifecycle::parse_recovery(
+        lifecycle->get_as<std::string>("on_timeout").value_or("none"));
+    m_max_relaunch = lifecycle->get_as<int64_t>("max_relaunch")
+                         .value_or(m_max_relaunch);
+  }
+
+  // setup window to collapse bursts of taps and focus changes (msec)
+  auto coalesce = config->get_table("coalesce");
+  int64_t window = 100;
+  if (coalesce)
+    window = coalesce->get_as<int64_t>("window").value_or(window);
+  m_tap.set_window(window);
+  m_focus.set_window(window);
+
+  // intents before the surface is set up expire after (msec)
+  auto intents = config->get_table("intents");
+  if (intents) {
+    m_intent_timeout = intents->get_as<int64_t>("timeout")
+                           .value_or(m_intent_timeout);
+  }
+
+  // backoff of reconnection to the binder (msec)
+  auto reconnect = config->get_table("reconnect");
+  if (reconnect) {
+    m_reconnect_min = reconnect->get_as<int64_t>("backoff_min")
+                          .value_or(m_reconnect_min);
+    m_reconnect_max = reconnect->get_as<int64_t>("backoff_max")
+                          .value_or(m_reconnect_max);
+    if (m_reconnect_min <= 0 || m_reconnect_max < m_reconnect_min)
+      AGL_FATAL("invalid backoff of reconnection");
+  }
+
+  // EndDraw right at SyncDraw, or once the app has drawn a new frame
+  auto wm = config->get_table("wm");
+  if (wm) {
+    std::string end_draw =
+        wm->get_as<std::string>("end_draw").value_or("immediate");
+    if (end_draw == "frame")
+      m_end_draw_on_frame = true;
+    else if (end_draw != "immediate")
+      AGL_FATAL("Unknown end_draw: %s", end_draw.c_str());
+    m_frame_timeout = wm->get_as<int64_t>("frame_timeout")
+                          .value_or(m_frame_timeout);
+  }
+
+  // surfaces of the app after the main one
+  auto surfaces = config->get_table("surfaces");
+  if (surfaces) {
+    m_secondary_kind = AppSurface::parse_kind(
+        surfaces->get_as<std::string>("secondary").value_or("popup"));
+    if (m_secondary_kind == AppSurface::KIND_MAIN) {
+      AGL_FATAL("secondary surfaces can't be main");
+    }
+    m_main_by_app =
+        surfaces->get_as<std::string>("main").value_or("any") == "app";
+
+    m_kind_role[AppSurface::KIND_POPUP] =
+        surfaces->get_as<std::string>("popup").value_or("");
+    m_kind_area[AppSurface::KIND_POPUP] =
+        surfaces->get_as<std::string>("popup_area").value_or("normal.full");
+    m_kind_role[AppSurface::KIND_OVERLAY] =
+        surfaces->get_as<std::string>("overlay").value_or("");
+    m_kind_area[AppSurface::KIND_OVERLAY] =
+        surfaces->get_as<std::string>("overlay_area").value_or("on_screen");
+  }
+
+  // the app may be containerized, known by afm with a pid of its own
+  auto container = config->get_table("container");
+  if (container) {
+    m_pidns_enabled =
+        container->get_as<bool>("pid_namespace").value_or(false);
+  }
+
+  // surface ownership shared with the other instances of the session
+  auto shared = config->get_table("shared");
+  if (shared && shared->get_as<bool>("enabled").value_or(false)) {
+    m_shared_path =
+        shared->get_as<std::string>("path").value_or("/dev/shm/runxdg");
+  }
+
+  // rules attributing surfaces, in order of precedence
+  auto rules = config->get_table_array("match");
+  if (rules) {
+    for (const auto& rule : *rules) {
+      SurfaceMatcher::RuleSpec spec;
+      spec.name = rule->get_as<std::string>("name").value_or("");
+      spec.action = rule->get_as<std::string>("action").value_or("main");
+      spec.exe = rule->get_as<std::string>("exe").value_or("");
+      spec.cmdline = rule->get_as<std::string>("cmdline").value_or("");
+      spec.ancestry = rule->get_as<std::string>("ancestry").value_or("");
+      spec.cgroup = rule->get_as<std::string>("cgroup").value_or("");
+      spec.min_width = rule->get_as<int64_t>("min_width").value_or(0);
+      spec.max_width = rule->get_as<int64_t>("max_width").value_or(0);
+      spec.min_height = rule->get_as<int64_t>("min_height").value_or(0);
+      spec.max_height = rule->get_as<int64_t>("max_height").value_or(0);
+      spec.order = rule->get_as<int64_t>("order").value_or(0);
+      spec.foreign = rule->get_as<bool>("foreign").value_or(false);
+      m_matcher.add_rule(spec);
+    }
+  }
+
   POSIXLauncher *pl;
 
   /* Setup API of launcher */
@@ -401,9 +1284,11 @@ int RunXDG::parse_config (const char *path_to_config)
     m_launcher = pl;
   } else if (method == "AFM_DBUS") {
     m_launcher = new AFMDBusLauncher();
+    m_launcher->m_pidns = m_pidns_enabled;
     return 0;
   } else if (method == "AFM_WEBSOCKET") {
     m_launcher = new AFMWebSocketLauncher();
+    m_launcher->m_pidns = m_pidns_enabled;
     return 0;
   } else {
     AGL_FATAL("Unknown type of launcher");
@@ -442,6 +1327,30 @@ int RunXDG::parse_config (const char *path_to_config)
     AGL_DEBUG("params[%s]", param.c_str());
   }
 
+  // setup capture of stdout/stderr of the app
+  auto log = config->get_table("log");
+  if (log) {
+    auto target = LogCapture::parse_target(
+        log->get_as<std::string>("target").value_or("inherit"));
+    auto log_path = log->get_as<std::string>("path").value_or("");
+    auto max_size = log->get_as<int64_t>("max_size").value_or(1024 * 1024);
+    auto rotate = log->get_as<int64_t>("rotate").value_or(1);
+
+    if ((target == LogCapture::TARGET_FILE ||
+         target == LogCapture::TARGET_BOTH) && log_path.empty()) {
+      AGL_FATAL("No path defined in [log]");
+    }
+    if (max_size <= 0 || rotate < 0) {
+      AGL_FATAL("Invalid max_size or rotate in [log]");
+    }
+
+    if (target != LogCapture::TARGET_INHERIT) {
+      AGL_DEBUG("capture app log: path=[%s], max_size=%lld, rotate=%lld",
+                log_path.c_str(), (long long)max_size, (long long)rotate);
+      pl->m_log = new LogCapture(target, m_role, log_path, max_size, rotate);
+    }
+  }
+
   return 0;
 }
 
@@ -464,155 +1373,819 @@ RunXDG::RunXDG (int port, const char* token, const char* id)
             m_id.c_str(), m_role.c_str(), m_path.c_str(),
             m_port, m_token.c_str());
 
-  // Setup HomeScreen/WindowManager API
-  if (init_wm())
-    AGL_FATAL("cannot setup wm API");
+  // Signals are handled by the reactor, block them before any thread
+  // of WM/HS/ILM library starts.
+  Reactor::block_signals({ SIGTERM, SIGCHLD, SIGUSR1 });
 
-  if (init_hs())
-    AGL_FATAL("cannot setup hs API");
+  // only the reactor and the launcher
+  if (m_service) {
+    AGL_DEBUG("RunXDG created (service).");
+    return;
+  }
 
-  // Setup ilmController API
-  m_ic = new ILMControl(notify_ivi_control_cb_static, this);
+  m_ilm_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (m_ilm_fd < 0)
+    AGL_FATAL("cannot create eventfd");
+  m_reactor.add_fd(m_ilm_fd, EPOLLIN, [this](uint32_t events) {
+    process_ilm_queue();
+  });
+
+  // Setup ilmController API before the app is launched, so that no
+  // surface of the app is missed. HomeScreen/WindowManager API are set
+  // up in start() while the app starts.
+  m_ic = new ILMControl(nullptr, nullptr);
+  if (!m_shared_path.empty())
+    setup_shared();
+  if (!m_shared) {
+    m_ic->subscribe(notify_ivi_control_cb_static, this);
+
+    // Surfaces which exist already are never notified, e.g. when the app
+    // has been prelaunched or runxdg is restarted.
+    sync_surfaces();
+  }
+  m_reactor.add_flush_handler([this]() {
+    m_ic->flush();
+  });
 
   AGL_DEBUG("RunXDG created.");
 }
 
+void RunXDG::wm_request (const char *verb, json_object *obj,
+                         AFBClient::ReplyHandler handler)
+{
+  if (m_afb.call("windowmanager", verb, obj, handler) < 0 && handler)
+    handler(false, nullptr);
+}
+
+void RunXDG::watch_frames (t_ilm_surface id)
+{
+  if (!m_end_draw_on_frame || m_frames.count(id))
+    return;
+
+  // before the first notification can come
+  g_frame_watcher.store(this);
+  if (ilm_surfaceAddNotification(id, notify_surface_cb_static) !=
+      ILM_SUCCESS) {
+    AGL_WARN("cannot watch frames of surface (id=%d)", id);
+    return;
+  }
+
+  // baseline until the first notification
+  Frame frame = { 0, 0, 0 };
+  const SurfaceRegistry::Surface *surface = m_surfaces.find(id);
+  if (surface) {
+    frame.counter = surface->props.frameCounter;
+    frame.width = surface->props.origSourceWidth;
+    frame.height = surface->props.origSourceHeight;
+  }
+  m_frames[id] = frame;
+}
+
+void RunXDG::sync_draw (const Payloads *payloads)
+{
+  t_ilm_surface id = 0;
+
+  if (payloads->role == m_role) {
+    id = m_ivi_id;
+  } else {
+    for (const auto& secondary : m_secondaries) {
+      if (m_kind_role[secondary.second.kind] == payloads->role) {
+        id = secondary.first;
+        break;
+      }
+    }
+  }
+
+  auto frame = m_frames.find(id);
+  if (frame == m_frames.end()) {
+    // not watched, WM gets a frame drawn before the new area
+    wm_request("EndDraw", json_object_get(payloads->end_draw), nullptr);
+    return;
+  }
+
+  // a SyncDraw following another one waits for the same frame
+  for (const auto& draw : m_draws) {
+    if (draw.payloads == payloads)
+      return;
+  }
+
+  PendingDraw draw = { payloads, id, frame->second, Reactor::now_us() };
+  m_reactor.arm_timer(payloads->draw_timer, m_frame_timeout);
+  m_draws.push_back(draw);
+}
+
+void RunXDG::draw_timeout (const Payloads *payloads)
+{
+  for (size_t i = 0; i < m_draws.size(); ++i) {
+    if (m_draws[i].payloads == payloads) {
+      AGL_DEBUG("no frame of <%s>, EndDraw anyway", payloads->role.c_str());
+      m_draws_timed_out++;
+      end_draw(i);
+      break;
+    }
+  }
+}
+
+void RunXDG::frame_committed (t_ilm_surface id, const Frame& frame)
+{
+  auto itr = m_frames.find(id);
+  if (itr == m_frames.end())
+    return;
+  itr->second = frame;
+
+  for (size_t i = 0; i < m_draws.size(); ) {
+    const PendingDraw& draw = m_draws[i];
+    if (draw.id == id &&
+        (frame.counter != draw.frame.counter ||
+         frame.width != draw.frame.width ||
+         frame.height != draw.frame.height)) {
+      m_draws_framed++;
+      end_draw(i);
+    } else {
+      ++i;
+    }
+  }
+}
+
+void RunXDG::end_draw (size_t index)
+{
+  PendingDraw draw = m_draws[index];
+
+  m_reactor.disarm_timer(draw.payloads->draw_timer);
+  m_draws[index] = m_draws.back();
+  m_draws.pop_back();
+
+  m_draw_wait.add(Reactor::now_us() - draw.since);
+  wm_request("EndDraw", json_object_get(draw.payloads->end_draw), nullptr);
+}
+
 void RunXDG::setup_surface (void)
+{
+  watch_frames(m_ivi_id);
+  m_lifecycle.enter(Lifecycle::STATE_REGISTERING);
+  m_focus.reset();
+
+  // registered by register_surfaces() once connected, intents wait
+  if (!m_afb.connected())
+    return;
+
+  request_surface();
+
+  // pipelined right behind requestSurfaceXDG, no wait for its reply
+  replay_intents();
+}
+
+void RunXDG::request_surface (void)
 {
   std::string sid = std::to_string(m_ivi_id);
 
   // This surface is mine, register pair app_name and ivi id.
   json_object *obj = json_object_new_object();
-  json_object_object_add(obj, m_wm->kKeyDrawingName,
+  json_object_object_add(obj, kKeyDrawingName,
                          json_object_new_string(m_role.c_str()));
-  json_object_object_add(obj, m_wm->kKeyIviId,
+  json_object_object_add(obj, kKeyIviId,
                          json_object_new_string(sid.c_str()));
 
   AGL_DEBUG("requestSurfaceXDG(%s,%s)", m_role.c_str(), sid.c_str());
-  m_wm->requestSurfaceXDG(obj);
+  m_registered = false;
+
+  wm_request("RequestSurfaceXDG", obj, [this](bool ok, json_object *reply) {
+    if (!ok) {
+      // left to the deadline of registering
+      AGL_WARN("requestSurfaceXDG failed");
+      return;
+    }
 
-  if (m_pending_create) {
-    // Recovering 1st time tap_shortcut is dropped because
-    // the application has not been run yet (1st time launch)
-    m_pending_create = false;
+    m_registered = true;
+    if (m_lifecycle.state() == Lifecycle::STATE_REGISTERING) {
+      m_lifecycle.enter(Lifecycle::STATE_BACKGROUND);
+      m_relaunch_count = 0;
+    }
 
-    json_object *obj = json_object_new_object();
-    json_object_object_add(obj, m_wm->kKeyDrawingName,
-                           json_object_new_string(m_role.c_str()));
-    json_object_object_add(obj, m_wm->kKeyDrawingArea,
-                           json_object_new_string("normal.full"));
-    m_wm->activateSurface(obj);
+    if (m_retry_activate) {
+      m_retry_activate = false;
+      activate_surface("normal.full");
+    }
+  });
+}
+
+void RunXDG::classify_surface (const SurfaceRegistry::Surface& surface)
+{
+  pid_t pid = surface.pid;
+  SurfaceMatcher::Relation relation = SurfaceMatcher::RELATION_FOREIGN;
+  if (pid == m_launcher->local_rid() || pid == m_launcher->m_local_rid) {
+    relation = SurfaceMatcher::RELATION_SELF;
+  } else if (m_launcher->owns(pid)) {
+    relation = SurfaceMatcher::RELATION_DESCENDANT;
+  } else if (m_pidns_enabled && !m_launcher->m_local_rid &&
+             m_pidns.matches(pid, m_launcher->m_rid, m_launch_ticks)) {
+    // The app runs in a pid namespace of its own, where it is m_rid.
+    // From now on, its processes are known by their pids in ours.
+    relation = SurfaceMatcher::RELATION_SELF;
+    m_launcher->adopt(pid);
+    if (m_shared)
+      m_shared->publish_app(m_launcher->m_rid, pid, m_launch_ticks);
+  }
+
+  SurfaceMatcher::Action action = SurfaceMatcher::ACTION_NONE;
+  if (!m_matcher.empty()) {
+    SurfaceMatcher::Candidate candidate = {
+      surface.id, pid, &surface.props, relation, m_surface_order + 1
+    };
+    action = m_matcher.match(candidate);
+  }
+
+  switch (action) {
+    case SurfaceMatcher::ACTION_NONE:
+      // default: any surface of the app, the first one is the main one
+      if (relation == SurfaceMatcher::RELATION_FOREIGN)
+        return;
+      if (!m_main_by_app || relation == SurfaceMatcher::RELATION_SELF)
+        attach_surface(surface.id, AppSurface::KIND_MAIN);
+      else
+        attach_surface(surface.id, m_secondary_kind);
+      break;
+    case SurfaceMatcher::ACTION_IGNORE:
+      break;
+    case SurfaceMatcher::ACTION_MAIN:
+      attach_surface(surface.id, AppSurface::KIND_MAIN);
+      break;
+    case SurfaceMatcher::ACTION_POPUP:
+      attach_surface(surface.id, AppSurface::KIND_POPUP);
+      break;
+    case SurfaceMatcher::ACTION_OVERLAY:
+      attach_surface(surface.id, AppSurface::KIND_OVERLAY);
+      break;
   }
 }
 
-void POSIXLauncher::register_surfpid (pid_t surf_pid)
+void RunXDG::attach_surface (t_ilm_surface id, AppSurface::Kind kind)
 {
-  if (surf_pid == m_rid) {
-    if (!std::count(m_pid_v.begin(), m_pid_v.end(), surf_pid)) {
-      AGL_DEBUG("surface creator(pid=%d) registered", surf_pid);
-      m_pid_v.push_back(surf_pid);
-      AGL_DEBUG("m_pid_v.count(%d) = %d", surf_pid,
-                std::count(m_pid_v.begin(), m_pid_v.end(), surf_pid));
+  if (id == m_ivi_id || m_secondaries.count(id))
+    return;
+  m_surface_order++;
+
+  // The main surface stays so until destroyed. Later ones never take
+  // its place nor set it up again.
+  if (kind == AppSurface::KIND_MAIN) {
+    if (!m_ivi_id) {
+      m_ivi_id = id;
+      setup_surface();
+      return;
     }
+    kind = m_secondary_kind;
   }
+
+  AppSurface surface = { id, kind, false };
+  AGL_DEBUG("secondary surface (id=%d, kind=%d) of <%s>", id,
+            surface.kind, m_role.c_str());
+  metrics().counter("surface.secondary")++;
+
+  setup_secondary(m_secondaries[id] = surface);
+}
+
+void RunXDG::setup_secondary (AppSurface& surface)
+{
+  const std::string& role = m_kind_role[surface.kind];
+  if (role.empty())
+    return;  // tracked only
+
+  watch_frames(surface.id);
+  if (!m_afb.connected())
+    return;  // registered by register_surfaces() once connected
+
+  std::string sid = std::to_string(surface.id);
+  json_object *obj = json_object_new_object();
+  json_object_object_add(obj, kKeyDrawingName,
+                         json_object_new_string(role.c_str()));
+  json_object_object_add(obj, kKeyIviId,
+                         json_object_new_string(sid.c_str()));
+
+  AGL_DEBUG("requestSurfaceXDG(%s,%s)", role.c_str(), sid.c_str());
+
+  t_ilm_surface id = surface.id;
+  AppSurface::Kind kind = surface.kind;
+  wm_request("RequestSurfaceXDG", obj, [this, id, kind](bool ok,
+                                                       json_object *reply) {
+    auto itr = m_secondaries.find(id);
+    if (!ok || itr == m_secondaries.end())
+      return;
+    itr->second.registered = true;
+
+    if (m_kind_area[kind].empty())
+      return;
+
+    wm_request("ActivateSurface",
+               activate_payload(m_kind_role[kind], m_kind_area[kind]),
+               nullptr);
+  });
+}
+
+const char* RunXDG::event_role (json_object *object)
+{
+  json_object *val;
+
+  if (object &&
+      json_object_object_get_ex(object, kKeyDrawingName, &val))
+    return json_object_get_string(val);
+  return m_role.c_str();
+}
+
+bool RunXDG::is_main_event (json_object *object)
+{
+  // focus and state follow the main surface only
+  return strcmp(event_role(object), m_role.c_str()) == 0;
 }
 
-void POSIXLauncher::unregister_surfpid (pid_t surf_pid)
+AppSurface::Kind AppSurface::parse_kind (const std::string& str)
 {
-  auto beg = m_pid_v.begin();
-  auto end = m_pid_v.end();
-  m_pid_v.erase(std::remove(beg, end, surf_pid), end);
-  AGL_DEBUG("Unregistered surface (id=%d sz=%u)", surf_pid, m_pid_v.size());
+  if (str == "main")
+    return KIND_MAIN;
+  if (str == "popup")
+    return KIND_POPUP;
+  if (str == "overlay")
+    return KIND_OVERLAY;
+
+  AGL_FATAL("Unknown kind of surface: %s", str.c_str());
+  return KIND_MAIN;
 }
 
-pid_t POSIXLauncher::find_surfpid_by_rid (pid_t rid)
+void RunXDG::queue_intent (Intent::Type type, const std::string& area,
+                           bool focus)
 {
-  AGL_DEBUG("find surfpid by rid(%d)", rid);
-  if (std::count(m_pid_v.begin(), m_pid_v.end(), rid)) {
-    AGL_DEBUG("found return(%d)", rid);
-    return rid;
+  // only the latest intent of a type matters
+  for (auto itr = m_intents.begin(); itr != m_intents.end(); ++itr) {
+    if (itr->type == type) {
+      m_intents.erase(itr);
+      metrics().counter("intent.replaced")++;
+      break;
+    }
   }
 
-  return -1;
+  Intent intent = { type, area, focus,
+                    Reactor::now_us() + m_intent_timeout * 1000 };
+  m_intents.push_back(intent);
+  metrics().counter("intent.queued")++;
 }
 
-void AFMLauncher::register_surfpid (pid_t surf_pid)
+void RunXDG::replay_intents (void)
 {
-  pid_t pgid = 0;
+  uint64_t now = Reactor::now_us();
+
+  while (!m_intents.empty()) {
+    Intent intent = m_intents.front();
+    m_intents.pop_front();
 
-  pgid = getpgid(surf_pid);
+    if (now > intent.deadline) {
+      AGL_DEBUG("drop stale intent (type=%d)", intent.type);
+      metrics().counter("intent.expired")++;
+      continue;
+    }
+
+    metrics().counter("intent.replayed")++;
+    switch (intent.type) {
+      case Intent::INTENT_ACTIVATE:
+        activate_surface(intent.area);
+        break;
+      case Intent::INTENT_FOCUS:
+        m_focus.request(intent.focus);
+        break;
+    }
+  }
+}
 
-  if (pgid < 0) {
-    AGL_DEBUG("fail to get process group id");
+void RunXDG::set_focus (bool focus)
+{
+  m_ic->set_focus(m_ivi_id, focus);
+}
+
+static json_object* new_payload (const char *key, const std::string& role,
+                                 const char *area_key = nullptr,
+                                 const std::string& area = "")
+{
+  json_object *obj = json_object_new_object();
+  json_object_object_add(obj, key, json_object_new_string(role.c_str()));
+  if (area_key) {
+    json_object_object_add(obj, area_key,
+                           json_object_new_string(area.c_str()));
+  }
+  return obj;
+}
+
+void RunXDG::add_payloads (const std::string& role, const std::string& area)
+{
+  if (role.empty())
     return;
+
+  Payloads *payloads = nullptr;
+  for (auto& entry : m_payloads) {
+    if (entry.role == role)
+      payloads = &entry;
+  }
+  if (!payloads) {
+    m_payloads.emplace_back();
+    payloads = &m_payloads.back();
+    payloads->role = role;
+    payloads->end_draw = new_payload(kKeyDrawingName, role);
+    payloads->draw_timer = -1;
+    if (m_end_draw_on_frame) {
+      payloads->draw_timer = m_reactor.create_timer([this, payloads]() {
+        draw_timeout(payloads);
+      });
+    }
   }
 
-  AGL_DEBUG("Surface creator is pid=%d, pgid=%d", surf_pid, pgid);
+  if (!area.empty() && !payloads->activate.count(area)) {
+    payloads->activate[area] = new_payload(kKeyDrawingName, role,
+                                           kKeyDrawingArea, area);
+  }
+}
 
-  if (!m_pgids.count(pgid)) {
-    m_pgids[pgid] = surf_pid;
+void RunXDG::build_payloads (void)
+{
+  // Requests of WM consume a reference, callers pass json_object_get()
+  // of these and they are never freed.
+  m_payloads.reserve(AppSurface::KIND_MAX);
+  add_payloads(m_role, "normal.full");
+  for (int kind = AppSurface::KIND_POPUP; kind < AppSurface::KIND_MAX; ++kind)
+    add_payloads(m_kind_role[kind], m_kind_area[kind]);
+}
+
+const RunXDG::Payloads* RunXDG::find_payloads (const char *role)
+{
+  // a handful of roles, no need of hashing (nor of a std::string)
+  for (const auto& payloads : m_payloads) {
+    if (strcmp(payloads.role.c_str(), role) == 0)
+      return &payloads;
   }
+  return nullptr;
 }
 
-void AFMLauncher::unregister_surfpid (pid_t surf_pid)
+json_object* RunXDG::activate_payload (const std::string& role,
+                                       const std::string& area)
 {
-  auto itr = m_pgids.begin();
-  while (itr != m_pgids.end()) {
-    if (itr->second == surf_pid) {
-      m_pgids.erase(itr++);
-    } else {
-      ++itr;
+  for (auto& payloads : m_payloads) {
+    if (payloads.role != role)
+      continue;
+
+    // an area unknown at startup is built once (reactor thread only,
+    // event handlers only look at end_draw)
+    json_object *&obj = payloads.activate[area];
+    if (!obj) {
+      obj = new_payload(kKeyDrawingName, role,
+                        kKeyDrawingArea, area);
     }
+    return json_object_get(obj);
   }
+
+  return new_payload(kKeyDrawingName, role,
+                     kKeyDrawingArea, area);
 }
 
-pid_t AFMLauncher::find_surfpid_by_rid (pid_t rid)
+void RunXDG::activate_surface (const std::string& area)
 {
-  auto itr = m_pgids.find(rid);
-  if (itr != m_pgids.end())
-    return itr->second;
+  json_object *obj = activate_payload(m_role, area);
 
-  return -1;
+  wm_request("ActivateSurface", obj, [this](bool ok, json_object *reply) {
+    if (!ok && !m_registered) {
+      // overtook requestSurfaceXDG in the binder, retry once registered
+      m_retry_activate = true;
+    }
+  });
 }
 
-void RunXDG::start (void)
+bool AFMLauncher::owns (pid_t pid)
+{
+  if (m_rid <= 0)
+    return false;
+
+  // a descendant of the app, wherever its pgrp is
+  if (m_tree.owns(pid))
+    return true;
+
+  pid_t rid = local_rid();
+  return rid > 0 && getpgid(pid) == rid;
+}
+
+void AFMLauncher::adopt (pid_t pid)
+{
+  if (pid == local_rid())
+    return;
+
+  AGL_DEBUG("app (rid=%d) is pid %d in runxdg's namespace", m_rid, pid);
+  m_local_rid = pid;
+  if (m_tree.active())
+    m_tree.add(pid);
+
+  // watched by its pid in our namespace only
+  if (m_pidfd >= 0) {
+    m_reactor->remove_fd(m_pidfd);
+    close(m_pidfd);
+    m_pidfd = -1;
+  }
+  watch_pid(pid);
+}
+
+void AFMLauncher::watch (Reactor& reactor)
+{
+  m_reactor = &reactor;
+
+  if (m_rid <= 0)
+    return;
+
+  // rid of afm is the pid of the app process (group leader). In a pid
+  // namespace, nothing is known of it in ours until adopt().
+  pid_t rid = local_rid();
+  if (m_tree.active()) {
+    if (rid > 0)
+      m_tree.add(rid);
+    m_tree.start(reactor);
+  }
+  if (rid > 0)
+    watch_pid(rid);
+}
+
+void AFMLauncher::watch_pid (pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  m_pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+  if (m_pidfd < 0) {
+    AGL_DEBUG("cannot open pidfd of pid(%d), rely on afm", pid);
+    return;
+  }
+
+  m_reactor->add_fd(m_pidfd, EPOLLIN, [this](uint32_t events) {
+    AGL_DEBUG("app (rid=%d) terminated", m_rid);
+    exited();
+  });
+}
+
+void AFMLauncher::exited (void)
+{
+  if (m_pidfd >= 0) {
+    m_reactor->remove_fd(m_pidfd);
+    close(m_pidfd);
+    m_pidfd = -1;
+  }
+
+  m_rid = 0;
+  m_local_rid = 0;
+  m_tree.clear();
+
+  if (m_on_exiting)
+    m_on_exiting();
+  if (m_on_exit)
+    m_on_exit();
+}
+
+void AFMLauncher::terminate (void)
 {
-  // Initialize SIGTERM handler
-  init_signal();
+  // without pidfd, there's no way to wait for the app
+  if (m_pidfd < 0)
+    exited();
+}
+
+void AFMLauncher::kill_all (void)
+{
+  pid_t pgid = local_rid();
+  if (pgid > 0) {
+    AGL_DEBUG("kill(-%d, SIGKILL)", pgid);
+    ::kill(-pgid, SIGKILL);
+  }
+  exited();
+}
+
+void RunXDG::launch_app (void)
+{
+  m_lifecycle.enter(Lifecycle::STATE_SPAWNING);
+
+  // Nothing of a previous launch is carried over, the surfaces of the
+  // exited app are not the new one's, even if destroyed late.
+  m_ivi_id = 0;
+  m_secondaries.clear();
+  m_frames.clear();
+  for (auto& draw : m_draws)
+    m_reactor.disarm_timer(draw.payloads->draw_timer);
+  m_draws.clear();
+  m_registered = false;
+  m_retry_activate = false;
+  m_intents.clear();
+  m_surface_order = 0;
+
+  // the container of the app, if any, is created from now
+  m_launch_ticks = PidNamespace::boot_ticks();
 
   /* Launch XDG application */
   m_launcher->m_rid = m_launcher->launch(m_id);
   if (m_launcher->m_rid < 0) {
-    AGL_FATAL("cannot launch XDG app (%s)", m_id);
+    AGL_FATAL("cannot launch XDG app (%s)", m_id.c_str());
   }
 
-  // take care 1st time launch
-  AGL_DEBUG("waiting for notification: surafce created");
-  m_pending_create = true;
+  // the broker attributes surfaces of the app to this instance from now
+  if (m_shared)
+    m_shared->publish_app(m_launcher->m_rid, 0,
+                          m_launcher->m_pidns ? m_launch_ticks : 0);
 
-  ilm_commitChanges();
+  if (m_service) {
+    // nothing to wait for, running is all a service does
+    m_lifecycle.enter(Lifecycle::STATE_ACTIVE);
+    m_launcher->watch(m_reactor);
+    return;
+  }
+
+  // take care 1st time launch, activate once the surface is set up
+  AGL_DEBUG("waiting for notification: surafce created");
+  queue_intent(Intent::INTENT_ACTIVATE, "normal.full", false);
+  m_lifecycle.enter(Lifecycle::STATE_WAITING_SURFACE);
 
   // in case, target app has already run
-  if (m_launcher->m_rid) {
-    pid_t surf_pid = m_launcher->find_surfpid_by_rid(m_launcher->m_rid);
-    if (surf_pid > 0) {
-      AGL_DEBUG("match: surf:pid=%d, afm:rid=%d", surf_pid,
-                m_launcher->m_rid);
-      auto itr = m_surfaces.find(surf_pid);
-      if (itr != m_surfaces.end()) {
-        int id = itr->second;
-        AGL_DEBUG("surface %d for <%s> already exists", id,
-                  m_role.c_str());
-        m_ivi_id = id;
-        setup_surface();
+  attach_app_surface();
+
+  m_ic->mark_dirty();
+
+  m_launcher->watch(m_reactor);
+}
+
+void RunXDG::on_timeout (Lifecycle::State state)
+{
+  if (state == Lifecycle::STATE_EXITING) {
+    AGL_WARN("app is still alive, kill it");
+    m_launcher->kill_all();
+    return;
+  }
+
+  switch (m_recovery) {
+    case Lifecycle::RECOVERY_NONE:
+      return;
+
+    case Lifecycle::RECOVERY_RELAUNCH:
+      if (m_relaunch_count < m_max_relaunch) {
+        m_relaunch_count++;
+        m_relaunch = true;
+        AGL_WARN("relaunch app (%d/%d)", m_relaunch_count, m_max_relaunch);
+      } else {
+        AGL_WARN("app relaunched %d times, give up", m_relaunch_count);
       }
+      break;
+
+    case Lifecycle::RECOVERY_KILL:
+      AGL_WARN("kill app");
+      break;
+  }
+
+  m_lifecycle.enter(Lifecycle::STATE_EXITING);
+  m_launcher->terminate();
+}
+
+void RunXDG::on_app_exit (void)
+{
+  m_lifecycle.report();
+
+  if (m_shared)
+    m_shared->publish_app(0, 0, 0);
+
+  if (m_relaunch) {
+    m_relaunch = false;
+    launch_app();
+    return;
+  }
+
+  m_reactor.quit();
+}
+
+void RunXDG::init_api (void)
+{
+  uint64_t begin = Reactor::now_us();
+
+  if (init_wm())
+    AGL_FATAL("cannot setup wm API");
+
+  if (init_hs())
+    AGL_FATAL("cannot setup hs API");
+
+  m_afb.m_on_hangup = [this]() {
+    on_hangup();
+  };
+
+  // WM and HomeScreen share one connection to the binder, served by the
+  // reactor. Its handshake overlaps with the cold start of the app, and
+  // surfaces found meanwhile are registered once connected.
+  m_afb.connect(m_port, m_token, [this, begin](int ret) {
+    if (ret)
+      AGL_FATAL("cannot connect to the binder");
+
+    if (subscribe_events())
+      AGL_FATAL("cannot subscribe WM/HS events");
+
+    register_surfaces();
+
+    uint64_t elapsed = Reactor::now_us() - begin;
+    AGL_DEBUG("WM/HS API ready in %llu ms",
+              (unsigned long long)elapsed / 1000);
+    metrics().sample("startup.api_init_us", elapsed);
+  });
+}
+
+void RunXDG::on_hangup (void)
+{
+  // WM forgot the surfaces, or is about to
+  m_registered = false;
+  for (auto& draw : m_draws)
+    m_reactor.disarm_timer(draw.payloads->draw_timer);
+  m_draws.clear();
+
+  m_hangup_time = Reactor::now_us();
+  m_reconnect_delay = m_reconnect_min;
+  schedule_reconnect();
+}
+
+void RunXDG::schedule_reconnect (void)
+{
+  AGL_DEBUG("reconnect to the binder in %lld ms",
+            (long long)m_reconnect_delay);
+  m_reactor.add_timer(m_reconnect_delay, [this]() {
+    reconnect();
+  });
+}
+
+void RunXDG::reconnect (void)
+{
+  // the reactor keeps serving the app and ilm meanwhile
+  m_afb.connect(m_port, m_token, [this](int ret) {
+    if (ret) {
+      metrics().counter("afb.reconnect_failures")++;
+      m_reconnect_delay = std::min(m_reconnect_delay * 2, m_reconnect_max);
+      schedule_reconnect();
+      return;
     }
+
+    uint64_t elapsed = Reactor::now_us() - m_hangup_time;
+    AGL_DEBUG("reconnected to the binder in %llu ms",
+              (unsigned long long)elapsed / 1000);
+    metrics().counter("afb.reconnects")++;
+    metrics().sample("afb.reconnect_us", elapsed);
+
+    // Handlers are still registered, the new connection needs
+    // subscriptions and the surfaces of the app again.
+    if (subscribe_events())
+      AGL_WARN("cannot subscribe WM/HS events");
+
+    register_surfaces();
+  });
+}
+
+void RunXDG::register_surfaces (void)
+{
+  if (m_ivi_id) {
+    // WM may have restarted, shown again once registered
+    if (m_lifecycle.state() == Lifecycle::STATE_ACTIVE)
+      m_retry_activate = true;
+    request_surface();
+    replay_intents();
+  }
+  for (auto& secondary : m_secondaries) {
+    secondary.second.registered = false;
+    setup_secondary(secondary.second);
   }
+}
 
-  ilm_commitChanges();
-  m_launcher->loop(e_flag);
+void RunXDG::start (void)
+{
+  m_launcher->m_on_exiting = [this]() {
+    m_lifecycle.enter(Lifecycle::STATE_EXITING);
+  };
+  m_launcher->m_on_exit = [this]() {
+    on_app_exit();
+  };
+  m_lifecycle.set_timeout_handler([this](Lifecycle::State state) {
+    on_timeout(state);
+  });
+
+  m_reactor.add_signal(SIGTERM, [this](const struct signalfd_siginfo& info) {
+    AGL_DEBUG("catch SIGTERM");
+    m_relaunch = false;
+    m_lifecycle.enter(Lifecycle::STATE_EXITING);
+    m_launcher->terminate();
+  });
+
+  setup_stats();
+
+  launch_app();
+
+  if (!m_service)
+    init_api();
+
+  m_reactor.run();
+
+  export_stats();
+
+  // leave the slot, and the broker role to another instance
+  delete m_shared;
+  m_shared = nullptr;
 }
 
+#ifndef RUNXDG_BENCH  // bench_handlers has its own
 int main (int argc, const char* argv[])
 {
   // Set debug flags
@@ -648,3 +2221,4 @@ int main (int argc, const char* argv[])
 
   return 0;
 }
+#endif  // RUNXDG_BENCH
@@ -22,9 +22,18 @@
 #ifndef RUNXDG_HPP
 #define RUNXDG_HPP
 
+#include <signal.h>
+#include <unistd.h>
+
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_set>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <thread>
 #include <algorithm>
 
 #include <gio/gio.h>
@@ -32,8 +41,18 @@
 #include <ilm/ilm_control.h>
 #include <ilm/ilm_input.h>
 
-#include <libwindowmanager.h>
-#include <libhomescreen.hpp>
+#include "afb_client.hpp"
+#include "coalescer.hpp"
+#include "lifecycle.hpp"
+#include "log_capture.hpp"
+#include "metrics.hpp"
+#include "pid_namespace.hpp"
+#include "proc_tree.hpp"
+#include "reactor.hpp"
+#include "shared_registry.hpp"
+#include "spsc_queue.hpp"
+#include "surface_match.hpp"
+#include "surface_registry.hpp"
 
 #define AGL_FATAL(fmt, ...) fatal("ERROR: " fmt "\n", ##__VA_ARGS__)
 #define AGL_WARN(fmt, ...) warn("WARNING: " fmt "\n", ##__VA_ARGS__)
@@ -47,67 +66,158 @@ void debug (const char* format, ...);
 class ILMControl
 {
   public:
+    // without callback, no notification until subscribe()
     ILMControl(notificationFunc callback, void *user_data) {
         ilm_init();
-        ilm_registerNotification(callback, user_data);
+        if (callback)
+            subscribe(callback, user_data);
     }
 
     ~ILMControl(void) {
-        ilm_unregisterNotification();
+        if (m_subscribed)
+            ilm_unregisterNotification();
         ilm_destroy();
         AGL_DEBUG("ilm_destory().\n");
     }
+
+    void subscribe(notificationFunc callback, void *user_data) {
+        ilm_registerNotification(callback, user_data);
+        m_subscribed = true;
+    }
+
+    // Changes are buffered and sent by flush() with a single
+    // ilm_commitChanges(), once per iteration of the reactor.
+    void set_focus(t_ilm_surface id, bool focus) {
+        // the last change of a surface wins
+        std::vector<t_ilm_surface>& other = m_focus[!focus];
+        other.erase(std::remove(other.begin(), other.end(), id), other.end());
+        std::vector<t_ilm_surface>& ids = m_focus[focus];
+        if (std::find(ids.begin(), ids.end(), id) == ids.end())
+            ids.push_back(id);
+    }
+    void mark_dirty(void) { m_dirty = true; }
+    void flush(void);
+
+  private:
+    // pending focus changes, [0]: unset, [1]: set; capacity is kept
+    std::vector<t_ilm_surface> m_focus[2];
+    bool m_dirty = false;
+    uint64_t& m_commits = metrics().counter("ilm.commits");
+    bool m_subscribed = false;
 };
 
 class Launcher
 {
   public:
-    virtual void register_surfpid(pid_t surf_pid) = 0;
-    virtual void unregister_surfpid(pid_t surf_pid) = 0;
-    virtual pid_t find_surfpid_by_rid(pid_t app_pid) = 0;
+    virtual ~Launcher(void) {}
+
+    // whether pid (e.g. a surface creator) is a process of the app
+    virtual bool owns(pid_t pid) = 0;
+    // pid is the app process, seen from the pid namespace of runxdg
+    virtual void adopt(pid_t pid) {}
+    // whether launch() always starts new processes, which can't own a
+    // surface created before
+    virtual bool spawns(void) { return false; }
 
     virtual int launch(std::string& name) = 0;
-    virtual void loop(volatile sig_atomic_t& e_flag) = 0;
+    // watch the app in the reactor
+    virtual void watch(Reactor& reactor) = 0;
+    // ask the app to exit, kill_all() doesn't ask
+    virtual void terminate(void) = 0;
+    virtual void kill_all(void) = 0;
+
+    // called in the reactor when the app has terminated,
+    // and once every process of the app has gone
+    std::function<void(void)> m_on_exiting;
+    std::function<void(void)> m_on_exit;
 
     int m_rid = 0;
+    int m_local_rid = 0;  // m_rid in runxdg's pid namespace, if it differs
+    // m_rid is a pid in the app's own namespace, meaningless in ours
+    // until adopt() has given m_local_rid
+    bool m_pidns = false;
+
+    // the app process in runxdg's pid namespace, 0 if not known yet
+    pid_t local_rid(void) const { return m_pidns ? m_local_rid : m_rid; }
+
+  protected:
+    ProcTree m_tree;  // processes of the app, if the proc connector is usable
 };
 
 class POSIXLauncher : public Launcher
 {
   private:
-    std::vector<pid_t> m_pid_v;
+    std::set<pid_t> m_procs;  // live processes of the app (rid and descendants)
+
+    Reactor *m_reactor = nullptr;
+    int m_pidfd = -1;
+    bool m_rid_exited = false;
+    bool m_terminating = false;
+
+    void update_procs(void);
+    void kill_procs(int signum);
+    void reap(void);
 
   public:
     std::vector<std::string> m_args_v;
+    LogCapture *m_log = nullptr;
 
-    void register_surfpid(pid_t surf_pid);
-    void unregister_surfpid(pid_t surf_pid);
-    pid_t find_surfpid_by_rid(pid_t rid);
+    bool owns(pid_t pid);
+    bool spawns(void) { return true; }
 
     int launch(std::string& name);
-    void loop(volatile sig_atomic_t& e_flag);
+    void watch(Reactor& reactor);
+    void terminate(void);
+    void kill_all(void);
 };
 
 class AFMLauncher : public Launcher
 {
-  private:
-    std::map<int, int> m_pgids;  // pair of <afm:rid, ivi:pid>
+  protected:
+    Reactor *m_reactor = nullptr;
+    int m_pidfd = -1;
+
+    void exited(void);
+    void watch_pid(pid_t pid);
 
   public:
-    void register_surfpid(pid_t surf_pid);
-    void unregister_surfpid(pid_t surf_pid);
-    pid_t find_surfpid_by_rid(pid_t app_pid);
+    void watch(Reactor& reactor);
+    void terminate(void);
+    void kill_all(void);
+
+    bool owns(pid_t pid);
+    void adopt(pid_t pid);
 };
 
 class AFMDBusLauncher : public AFMLauncher
 {
   public:
+    ~AFMDBusLauncher(void);
+
     int launch(std::string& name);
-    void loop(volatile sig_atomic_t& e_flag) {
-      while (!(e_flag)) { sleep(60*60*24); } }
+    void watch(Reactor& reactor);
+    void terminate(void);
 
   private:
+    GDBusConnection *m_conn = nullptr;
+    GMainContext *m_context = nullptr;
+    GMainLoop *m_loop = nullptr;
+    std::thread m_thread;
+    std::atomic<pid_t> m_watched_rid{0};  // read by the GMainLoop thread
+
     int get_dbus_message_bus(GBusType bus_type, GDBusConnection* &conn);
+    void query_state(pid_t rid);  // GMainLoop thread only
+    void run_main_loop(void);
+
+    static void on_state(GObject *source, GAsyncResult *result,
+                         gpointer user_data);
+    static gboolean check_state(gpointer user_data);
+
+    static void on_changed(GDBusConnection *conn, const gchar *sender,
+                           const gchar *path, const gchar *interface,
+                           const gchar *signal, GVariant *params,
+                           gpointer user_data);
+    static pid_t signal_runid(GVariant *params);
 
     const char* DBUS_SERVICE   = "org.AGL.afm.user";
     const char* DBUS_PATH      = "/org/AGL/afm/user";
@@ -119,8 +229,50 @@ class AFMWebSocketLauncher : public AFMLauncher
   // not implemented yet
   public:
     int launch(std::string& name) { return 0; }
-    void loop(volatile sig_atomic_t& e_flag) {
-      while (!(e_flag)) { sleep(60*60*24); } }
+};
+
+struct ILMNotification
+{
+  ilmObjectType object;
+  t_ilm_uint id;
+  t_ilm_bool created;
+  uint64_t stamp;  // Reactor::now_us() on the ilmControl thread
+
+  // content committed to a surface, created is unused
+  bool frame;
+  t_ilm_uint frame_counter;
+  t_ilm_uint width, height;
+};
+
+// a surface of the app other than the main one
+struct AppSurface
+{
+  enum Kind {
+    KIND_MAIN,
+    KIND_POPUP,
+    KIND_OVERLAY,
+    KIND_MAX
+  };
+
+  t_ilm_surface id;
+  Kind kind;
+  bool registered;  // to WM, if the kind has a drawing name
+
+  static Kind parse_kind(const std::string& str);
+};
+
+// What is asked for the surface before it is set up
+struct Intent
+{
+  enum Type {
+    INTENT_ACTIVATE,  // incl. change of the area
+    INTENT_FOCUS
+  };
+
+  Type type;
+  std::string area;   // INTENT_ACTIVATE
+  bool focus;         // INTENT_FOCUS
+  uint64_t deadline;  // Reactor::now_us()
 };
 
 class RunXDG
@@ -131,10 +283,17 @@ class RunXDG
     void start(void);
     void notify_ivi_control_cb(ilmObjectType object, t_ilm_uint id,
                                t_ilm_bool created);
+    static void notify_surface_cb_static (t_ilm_surface id,
+                                          struct ilmSurfaceProperties *props,
+                                          t_ilm_notification_mask mask);
     static void notify_ivi_control_cb_static (ilmObjectType object,
                                               t_ilm_uint id,
                                               t_ilm_bool created,
                                               void *user_data);
+
+    // drives the WM/HS handlers, see bench/bench_handlers.cpp
+    friend class HandlerBench;
+
   private:
     std::string m_role;
     std::string m_path;
@@ -144,24 +303,164 @@ class RunXDG
     int m_port;
     std::string m_token;
 
+    Reactor m_reactor;
     Launcher *m_launcher;
 
-    LibWindowmanager *m_wm;
-    LibHomeScreen *m_hs;
-    ILMControl *m_ic;
-
-    t_ilm_surface m_ivi_id;
-
-    std::map<int, int> m_surfaces;  // pair of <afm:rid, ivi:id>
-
-    bool m_pending_create = false;
+    Lifecycle m_lifecycle{m_reactor};
+    Lifecycle::Recovery m_recovery = Lifecycle::RECOVERY_NONE;
+    int m_max_relaunch = 3;
+    int m_relaunch_count = 0;
+    bool m_relaunch = false;
+    bool m_service = false;  // no surface, no WM/HomeScreen/ilmControl
+
+    // collapse storms of taps and Active/Inactive events
+    Coalescer<bool> m_tap{m_reactor, "tap", false,
+                          [this](const bool& tap) {
+                            activate_surface("normal.full"); }};
+    Coalescer<bool> m_focus{m_reactor, "focus", true,
+                            [this](const bool& focus) { set_focus(focus); }};
+
+    AFBClient m_afb{m_reactor};  // WM and HomeScreen, one connection
+    ILMControl *m_ic = nullptr;
+
+    t_ilm_surface m_ivi_id = 0;
+
+    SurfaceRegistry m_surfaces;  // every ivi surface, of any app
+    std::unordered_set<t_ilm_surface> m_unresolved;  // properties not queried
+
+    std::deque<Intent> m_intents;
+    uint64_t m_intent_timeout = 30000;  // msec
+
+    bool m_registered = false;
+    bool m_retry_activate = false;
+
+    std::map<t_ilm_surface, AppSurface> m_secondaries;
+    AppSurface::Kind m_secondary_kind = AppSurface::KIND_POPUP;
+    bool m_main_by_app = false;  // only the app process creates the main one
+    SurfaceMatcher m_matcher;    // [match] rules
+    PidNamespace m_pidns;
+    uint64_t m_launch_ticks = 0;  // PidNamespace::boot_ticks() at launch
+
+    SharedRegistry *m_shared = nullptr;  // surface ownership across instances
+    std::string m_shared_path;           // empty: not shared
+
+    std::atomic<uint64_t> m_tap_wakeups{0};
+    uint64_t& m_taps_handled = metrics().counter("hs.tap.handled");
+    uint64_t& m_taps_routed = metrics().counter("hs.tap.routed");
+    bool m_pidns_enabled = false;  // app may run in its own pid namespace
+    unsigned int m_surface_order = 0;  // surfaces of the app since launch
+    // WM drawing name and area per kind, empty: not registered to WM
+    std::string m_kind_role[AppSurface::KIND_MAX];
+    std::string m_kind_area[AppSurface::KIND_MAX];
+
+    // ilmControl thread -> reactor
+    SPSCQueue<ILMNotification, 256> m_ilm_queue;
+    int m_ilm_fd = -1;
+    std::atomic<bool> m_ilm_wakeup{false};
+    std::atomic<uint64_t> m_ilm_overflow{0};
+    uint64_t m_ilm_synced_overflow = 0;  // overflows seen by sync_surfaces()
+    Metrics::Sample& m_ilm_depth = metrics().sample("ilm.queue_depth");
+    Metrics::Sample& m_ilm_latency = metrics().sample("ilm.latency_us");
+
+    std::string m_stats_path;
+    uint64_t m_stats_interval = 0;  // msec
+    uint64_t m_stats_time = 0;      // usec, for rates
+    uint64_t m_stats_commits = 0;
 
     int init_wm(void);
     int init_hs(void);
+    int hs_subscribe(const char *event);
+    int subscribe_events(void);
+    void init_api(void);
 
     int parse_config(const char *file);
 
     void setup_surface(void);
+    void request_surface(void);
+    void classify_surface(const SurfaceRegistry::Surface& surface);
+    void surface_destroyed(t_ilm_surface id);
+    void broker_surface(const SurfaceRegistry::Surface& surface);
+    void shared_event(const SharedRegistry::Event& event);
+    void setup_shared(void);
+    void route_tap(const std::string& name);
+    void attach_surface(t_ilm_surface id, AppSurface::Kind kind);
+    void setup_secondary(AppSurface& surface);
+    const char* event_role(json_object *object);  // drawing name of a WM event
+    bool is_main_event(json_object *object);
+
+    // WM requests of each drawing name of the app, built once
+    struct Payloads {
+      std::string role;
+      json_object *end_draw;
+      std::map<std::string, json_object*> activate;  // by area
+      int draw_timer;  // EndDraw without a frame, armed by each SyncDraw
+    };
+    std::vector<Payloads> m_payloads;  // not resized once WM is set up
+
+    void build_payloads(void);
+    void add_payloads(const std::string& role, const std::string& area);
+    const Payloads* find_payloads(const char *role);
+    json_object* activate_payload(const std::string& role,
+                                  const std::string& area);
+    void activate_surface(const std::string& area);
+    void set_focus(bool focus);
+
+    void queue_intent(Intent::Type type, const std::string& area,
+                      bool focus);
+    void replay_intents(void);
+    void wm_request(const char *verb, json_object *obj,
+                    AFBClient::ReplyHandler handler);
+
+    // EndDraw once the app has drawn after SyncDraw, not before
+    struct Frame {
+      t_ilm_uint counter;
+      t_ilm_uint width, height;
+    };
+    struct PendingDraw {
+      const Payloads *payloads;
+      t_ilm_surface id;
+      Frame frame;      // the last one before SyncDraw
+      uint64_t since;
+    };
+    bool m_end_draw_on_frame = false;  // [wm] end_draw = "frame"
+    int64_t m_frame_timeout = 100;     // msec, EndDraw anyway after
+    std::map<t_ilm_surface, Frame> m_frames;  // surfaces watched
+    std::vector<PendingDraw> m_draws;
+    uint64_t& m_draws_framed = metrics().counter("wm.end_draw.frame");
+    uint64_t& m_draws_timed_out = metrics().counter("wm.end_draw.timeout");
+    Metrics::Sample& m_draw_wait = metrics().sample("wm.end_draw_wait_us");
+
+    void watch_frames(t_ilm_surface id);
+    void sync_draw(const Payloads *payloads);
+    void draw_timeout(const Payloads *payloads);
+    void frame_committed(t_ilm_surface id, const Frame& frame);
+    void end_draw(size_t index);
+
+    void launch_app(void);
+    void on_timeout(Lifecycle::State state);
+    void on_app_exit(void);
+
+    void push_ilm_notification(const ILMNotification& notification);
+    void process_ilm_queue(void);
+
+    // the binder connection is recovered, with the state of the app
+    int64_t m_reconnect_min = 100;    // msec
+    int64_t m_reconnect_max = 5000;   // msec
+    int64_t m_reconnect_delay = 0;
+    uint64_t m_hangup_time = 0;
+
+    void on_hangup(void);
+    void schedule_reconnect(void);
+    void reconnect(void);
+    void register_surfaces(void);
+
+    void sync_surfaces(void);
+    const SurfaceRegistry::Surface* resolve_surface(t_ilm_surface id);
+    bool defer_surfaces(void);
+    void attach_app_surface(void);
+    void export_stats(void);
+    void setup_stats(void);
+    void arm_stats_timer(void);
 };
 
 #endif  // RUNXDG_HPP
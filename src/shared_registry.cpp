@@ -0,0 +1,689 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <fstream>
+#include <unordered_set>
+
+#include "runxdg.hpp"
+#include "metrics.hpp"
+#include "reactor.hpp"
+#include "shared_registry.hpp"
+
+#define SHARED_MAGIC 0x47445852  // "RXDG"
+#define SHARED_VERSION 3
+#define MAX_INSTANCES 64
+#define MAX_SURFACES 1024
+#define MAX_ANCESTRY 16
+#define MAX_ROLE 64
+#define MAX_READ_RETRIES 100  // a writer may have died in the middle
+
+/*
+ * Layout of the shared memory file. Each slot is written by its instance
+ * and each surface entry by the broker only, readers retry while the
+ * sequence is odd or has changed.
+ */
+struct Slot {
+  std::atomic<uint32_t> seq;
+  std::atomic<int32_t> instance;  // pid of runxdg, 0: free
+  std::atomic<int32_t> rid;
+  std::atomic<int32_t> local_rid;
+  std::atomic<uint64_t> since;    // boot ticks at launch if rid is inner
+  char role[MAX_ROLE];            // set once the slot is claimed
+};
+
+struct Entry {
+  std::atomic<uint32_t> seq;
+  std::atomic<uint32_t> id;       // 0: free
+  std::atomic<int32_t> creator;
+  std::atomic<int32_t> owner;     // pid of runxdg, 0: none
+};
+
+struct SharedRegistry::Shared {
+  uint32_t magic;
+  uint32_t version;
+  std::atomic<int32_t> broker;
+  Slot slots[MAX_INSTANCES];
+  Entry surfaces[MAX_SURFACES];
+};
+
+static void write_begin (std::atomic<uint32_t>& seq)
+{
+  seq.store(seq.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+static void write_end (std::atomic<uint32_t>& seq)
+{
+  seq.fetch_add(1, std::memory_order_release);
+}
+
+// A writer killed between write_begin() and write_end() leaves seq odd.
+// Its next writer, the only one, makes it even again before writing.
+static void write_reset (std::atomic<uint32_t>& seq)
+{
+  uint32_t val = seq.load(std::memory_order_relaxed);
+  if (val & 1)
+    seq.store(val + 1, std::memory_order_relaxed);
+}
+
+static bool read_slot (Slot& slot, pid_t& rid, pid_t& local_rid,
+                       uint64_t& since)
+{
+  // don't spin forever on a slot left odd by a dead instance
+  for (int retry = 0; retry < MAX_READ_RETRIES; ++retry) {
+    uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    rid = slot.rid.load(std::memory_order_relaxed);
+    local_rid = slot.local_rid.load(std::memory_order_relaxed);
+    since = slot.since.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!(seq & 1) && seq == slot.seq.load(std::memory_order_relaxed))
+      return true;
+  }
+  return false;
+}
+
+static bool read_role (Slot& slot, char *name)
+{
+  for (int retry = 0; retry < MAX_READ_RETRIES; ++retry) {
+    uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    memcpy(name, slot.role, MAX_ROLE);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!(seq & 1) && seq == slot.seq.load(std::memory_order_relaxed)) {
+      name[MAX_ROLE - 1] = '\0';
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool read_entry (Entry& entry, t_ilm_surface& id, pid_t& creator,
+                        pid_t& owner)
+{
+  // a broker may have died in the middle of a write, don't spin forever
+  for (int retry = 0; retry < MAX_READ_RETRIES; ++retry) {
+    uint32_t seq = entry.seq.load(std::memory_order_acquire);
+    id = entry.id.load(std::memory_order_relaxed);
+    creator = entry.creator.load(std::memory_order_relaxed);
+    owner = entry.owner.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!(seq & 1) && seq == entry.seq.load(std::memory_order_relaxed))
+      return true;
+  }
+  return false;
+}
+
+static pid_t parent_of (pid_t pid)
+{
+  std::ifstream ifs("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat((std::istreambuf_iterator<char>(ifs)),
+                   std::istreambuf_iterator<char>());
+
+  // "pid (comm) state ppid ...", comm may contain spaces and parens
+  size_t pos = stat.rfind(')');
+  pid_t ppid = 0;
+  if (pos == std::string::npos ||
+      sscanf(stat.c_str() + pos + 1, " %*c %d", &ppid) != 1)
+    return 0;
+  return ppid;
+}
+
+static void instance_address (pid_t pid, struct sockaddr_un& addr,
+                              socklen_t& len)
+{
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  // abstract namespace, nothing to clean up
+  int n = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+                   "runxdg.%d", pid);
+  len = offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+SharedRegistry::SharedRegistry (Reactor& reactor, const std::string& path,
+                                const std::string& role)
+  : m_reactor(reactor), m_path(path), m_role(role), m_self(getpid()),
+    m_alive(std::make_shared<std::atomic<bool>>(true))
+{
+}
+
+SharedRegistry::~SharedRegistry (void)
+{
+  *m_alive = false;
+  // blocked in flock(), released with the process
+  if (m_election.joinable())
+    m_election.detach();
+
+  if (m_sock >= 0) {
+    m_reactor.remove_fd(m_sock);
+    close(m_sock);
+  }
+
+  if (m_shared) {
+    if (m_slot >= 0)
+      release_slot(m_slot);
+    if (m_broker)
+      m_shared->broker.store(0);
+    munmap(m_shared, sizeof(Shared));
+  }
+
+  if (m_shm_fd >= 0)
+    close(m_shm_fd);
+  // hands over to a waiting instance
+  if (m_lock_fd >= 0)
+    close(m_lock_fd);
+}
+
+int SharedRegistry::open (void)
+{
+  if (map() || claim_slot() || bind_socket())
+    return -1;
+
+  elect();
+  return 0;
+}
+
+int SharedRegistry::map (void)
+{
+  m_shm_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (m_shm_fd < 0) {
+    AGL_WARN("cannot open %s (%s)", m_path.c_str(), strerror(errno));
+    return -1;
+  }
+
+  // only the first instance initializes it
+  flock(m_shm_fd, LOCK_EX);
+
+  struct stat st;
+  if (fstat(m_shm_fd, &st) < 0 ||
+      (st.st_size < (off_t)sizeof(Shared) &&
+       ftruncate(m_shm_fd, sizeof(Shared)) < 0)) {
+    AGL_WARN("cannot size %s (%s)", m_path.c_str(), strerror(errno));
+    flock(m_shm_fd, LOCK_UN);
+    return -1;
+  }
+
+  void *addr = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED,
+                    m_shm_fd, 0);
+  if (addr == MAP_FAILED) {
+    AGL_WARN("cannot map %s (%s)", m_path.c_str(), strerror(errno));
+    flock(m_shm_fd, LOCK_UN);
+    return -1;
+  }
+  m_shared = static_cast<Shared*>(addr);
+
+  if (m_shared->magic != SHARED_MAGIC ||
+      m_shared->version != SHARED_VERSION) {
+    memset((void *)m_shared, 0, sizeof(Shared));
+    m_shared->version = SHARED_VERSION;
+    m_shared->magic = SHARED_MAGIC;
+  }
+
+  flock(m_shm_fd, LOCK_UN);
+  return 0;
+}
+
+int SharedRegistry::claim_slot (void)
+{
+  // against another instance reclaiming the same dead slot
+  flock(m_shm_fd, LOCK_EX);
+
+  for (int i = 0; i < MAX_INSTANCES; ++i) {
+    Slot& slot = m_shared->slots[i];
+    int32_t instance = slot.instance.load();
+
+    // free, or left by a crashed instance
+    if (instance != 0 && (::kill(instance, 0) == 0 || errno != ESRCH))
+      continue;
+    if (!slot.instance.compare_exchange_strong(instance, m_self))
+      continue;
+
+    m_slot = i;
+    write_reset(slot.seq);
+    write_begin(slot.seq);
+    strncpy(slot.role, m_role.c_str(), MAX_ROLE - 1);
+    slot.role[MAX_ROLE - 1] = '\0';
+    write_end(slot.seq);
+    flock(m_shm_fd, LOCK_UN);
+
+    publish_app(0, 0, 0);
+    return 0;
+  }
+
+  flock(m_shm_fd, LOCK_UN);
+  AGL_WARN("no free slot in %s", m_path.c_str());
+  return -1;
+}
+
+void SharedRegistry::release_slot (int slot)
+{
+  Slot& s = m_shared->slots[slot];
+  write_begin(s.seq);
+  s.role[0] = '\0';
+  s.rid.store(0, std::memory_order_relaxed);
+  s.local_rid.store(0, std::memory_order_relaxed);
+  s.since.store(0, std::memory_order_relaxed);
+  write_end(s.seq);
+  s.instance.store(0);
+}
+
+int SharedRegistry::bind_socket (void)
+{
+  m_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (m_sock < 0) {
+    AGL_WARN("cannot create socket (%s)", strerror(errno));
+    return -1;
+  }
+
+  // Any process may send to an abstract socket, the credentials of the
+  // sender are checked by receive()
+  int on = 1;
+  if (setsockopt(m_sock, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
+    AGL_WARN("cannot pass credentials (%s)", strerror(errno));
+    close(m_sock);
+    m_sock = -1;
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  socklen_t len;
+  instance_address(m_self, addr, len);
+  if (bind(m_sock, (struct sockaddr *)&addr, len) < 0) {
+    AGL_WARN("cannot bind socket (%s)", strerror(errno));
+    close(m_sock);
+    m_sock = -1;
+    return -1;
+  }
+
+  m_reactor.add_fd(m_sock, EPOLLIN, [this](uint32_t events) {
+    receive();
+  });
+  return 0;
+}
+
+void SharedRegistry::elect (void)
+{
+  std::string lock_path = m_path + ".broker";
+  m_lock_fd = ::open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (m_lock_fd < 0) {
+    AGL_WARN("cannot open %s (%s)", lock_path.c_str(), strerror(errno));
+    return;
+  }
+
+  // known right away, so that only the broker subscribes to events
+  if (flock(m_lock_fd, LOCK_EX | LOCK_NB) == 0) {
+    become_broker();
+    return;
+  }
+
+  // wait for the broker to go away
+  int fd = m_lock_fd;
+  Reactor *reactor = &m_reactor;
+  std::shared_ptr<std::atomic<bool>> alive = m_alive;
+  m_election = std::thread([this, fd, reactor, alive]() {
+    while (flock(fd, LOCK_EX) < 0 && errno == EINTR)
+      ;
+    if (*alive)
+      reactor->post([this]() { become_broker(); });
+  });
+}
+
+void SharedRegistry::become_broker (void)
+{
+  AGL_DEBUG("runxdg (pid=%d) is the broker of %s", m_self, m_path.c_str());
+  m_broker = true;
+  m_shared->broker.store(m_self);
+  metrics().set("shared.broker", 1);
+
+  load_surfaces();
+
+  if (m_on_broker)
+    m_on_broker();
+}
+
+void SharedRegistry::publish_app (pid_t rid, pid_t local_rid,
+                                  uint64_t since)
+{
+  if (m_slot < 0)
+    return;
+
+  Slot& slot = m_shared->slots[m_slot];
+  write_begin(slot.seq);
+  slot.rid.store(rid, std::memory_order_relaxed);
+  slot.local_rid.store(local_rid, std::memory_order_relaxed);
+  slot.since.store(since, std::memory_order_relaxed);
+  write_end(slot.seq);
+
+  if (rid <= 0)
+    return;
+
+  // the broker may hold surfaces of the app already
+  if (m_broker) {
+    Event event;
+    memset(&event, 0, sizeof(event));
+    event.type = Event::EVENT_SLOT;
+    event.sender = m_self;
+    if (m_on_event)
+      m_on_event(event);
+  } else {
+    pid_t broker = m_shared->broker.load();
+    if (broker > 0)
+      send(broker, Event::EVENT_SLOT, 0, 0, nullptr);
+  }
+}
+
+pid_t SharedRegistry::find_owner (pid_t creator)
+{
+  struct App {
+    pid_t instance;
+    pid_t rid;        // not a pid of ours if since is set
+    pid_t local_rid;
+    uint64_t since;
+  };
+  App apps[MAX_INSTANCES];
+  int count = 0;
+
+  for (int i = 0; i < MAX_INSTANCES; ++i) {
+    Slot& slot = m_shared->slots[i];
+    App& app = apps[count];
+    app.instance = slot.instance.load();
+    if (app.instance == 0 ||
+        !read_slot(slot, app.rid, app.local_rid, app.since))
+      continue;
+    if (app.rid > 0)
+      count++;
+  }
+  if (count == 0)
+    return 0;
+
+  // The app process itself, its process group, then its descendants,
+  // also once orphaned and reparented to the instance, their subreaper.
+  pid_t pgid = getpgid(creator);
+  pid_t pid = creator;
+  pid_t owner = 0;
+  for (int depth = 0; depth < MAX_ANCESTRY && pid > 1 && !owner; ++depth) {
+    uint64_t latest = 0;
+    for (int i = 0; i < count; ++i) {
+      const App& app = apps[i];
+      pid_t rid = app.since ? app.local_rid : app.rid;
+      if (rid > 0 && (pid == rid || (depth == 0 && pgid == rid)))
+        return app.instance;
+      if (depth > 0 && pid == app.instance)
+        return app.instance;
+
+      // Containerized, not adopted by its instance yet: known by its pid
+      // in the container. Of the apps launched before pid started, the
+      // last one.
+      if (app.since && !app.local_rid && app.since >= latest &&
+          m_pidns.matches(pid, app.rid, app.since)) {
+        owner = app.instance;
+        latest = app.since;
+      }
+    }
+    m_pidns.forget(pid);  // pids are reused, not worth caching
+    pid = parent_of(pid);
+  }
+
+  return owner;
+}
+
+pid_t SharedRegistry::find_role (const std::string& role)
+{
+  char name[MAX_ROLE];
+
+  for (int i = 0; i < MAX_INSTANCES; ++i) {
+    Slot& slot = m_shared->slots[i];
+    pid_t instance = slot.instance.load();
+    if (instance == 0)
+      continue;
+
+    if (read_role(slot, name) && role == name)
+      return instance;
+  }
+  return 0;
+}
+
+void SharedRegistry::load_surfaces (void)
+{
+  // What the previous broker published is taken over, owners know their
+  // surfaces already. Torn entries are dropped, resolved again if alive.
+  m_index.clear();
+  m_free.clear();
+  for (int i = MAX_SURFACES - 1; i >= 0; --i) {
+    Entry& entry = m_shared->surfaces[i];
+    t_ilm_surface id;
+    pid_t creator, owner;
+    if (read_entry(entry, id, creator, owner) && id != 0 &&
+        !m_index.count(id)) {
+      m_index[id] = i;
+      continue;
+    }
+
+    write_reset(entry.seq);
+    write_begin(entry.seq);
+    entry.id.store(0, std::memory_order_relaxed);
+    write_end(entry.seq);
+    m_free.push_back(i);
+  }
+  metrics().set("shared.loaded", m_index.size());
+}
+
+pid_t SharedRegistry::published (t_ilm_surface id)
+{
+  auto itr = m_index.find(id);
+  if (itr == m_index.end())
+    return -1;
+  return m_shared->surfaces[itr->second].owner.load(std::memory_order_relaxed);
+}
+
+std::vector<std::pair<t_ilm_surface, pid_t>>
+SharedRegistry::retain_surfaces (const t_ilm_surface *ids, int count)
+{
+  std::unordered_set<t_ilm_surface> alive(ids, ids + count);
+  std::vector<std::pair<t_ilm_surface, pid_t>> gone;
+
+  for (const auto& published : m_index) {
+    if (!alive.count(published.first)) {
+      Entry& entry = m_shared->surfaces[published.second];
+      gone.emplace_back(published.first,
+                        entry.owner.load(std::memory_order_relaxed));
+    }
+  }
+  for (const auto& surface : gone)
+    remove_surface(surface.first);
+
+  return gone;
+}
+
+void SharedRegistry::publish_surface (t_ilm_surface id, pid_t creator,
+                                      pid_t owner)
+{
+  int index;
+  auto itr = m_index.find(id);
+  if (itr != m_index.end()) {
+    index = itr->second;
+  } else {
+    if (m_free.empty()) {
+      AGL_WARN("shared surface table is full, drop (id=%d)", id);
+      return;
+    }
+    index = m_free.back();
+    m_free.pop_back();
+    m_index[id] = index;
+  }
+
+  Entry& entry = m_shared->surfaces[index];
+  write_begin(entry.seq);
+  entry.id.store(id, std::memory_order_relaxed);
+  entry.creator.store(creator, std::memory_order_relaxed);
+  entry.owner.store(owner, std::memory_order_relaxed);
+  write_end(entry.seq);
+}
+
+pid_t SharedRegistry::remove_surface (t_ilm_surface id)
+{
+  auto itr = m_index.find(id);
+  if (itr == m_index.end())
+    return 0;
+
+  Entry& entry = m_shared->surfaces[itr->second];
+  pid_t owner = entry.owner.load(std::memory_order_relaxed);
+  write_begin(entry.seq);
+  entry.id.store(0, std::memory_order_relaxed);
+  write_end(entry.seq);
+
+  m_free.push_back(itr->second);
+  m_index.erase(itr);
+  return owner;
+}
+
+std::vector<t_ilm_surface> SharedRegistry::adoptable_surfaces (pid_t instance)
+{
+  std::vector<t_ilm_surface> ids;
+
+  for (const auto& published : m_index) {
+    Entry& entry = m_shared->surfaces[published.second];
+    if (entry.owner.load(std::memory_order_relaxed) != 0)
+      continue;
+    if (find_owner(entry.creator.load(std::memory_order_relaxed)) == instance)
+      ids.push_back(published.first);
+  }
+  return ids;
+}
+
+int SharedRegistry::send (pid_t instance, Event::Type type, t_ilm_surface id,
+                          pid_t creator,
+                          const struct ilmSurfaceProperties *props)
+{
+  Event event;
+  memset(&event, 0, sizeof(event));
+  event.type = type;
+  event.sender = m_self;
+  event.id = id;
+  event.creator = creator;
+  if (props)
+    event.props = *props;
+
+  struct sockaddr_un addr;
+  socklen_t len;
+  instance_address(instance, addr, len);
+
+  if (sendto(m_sock, &event, sizeof(event), MSG_DONTWAIT,
+             (struct sockaddr *)&addr, len) < 0) {
+    AGL_WARN("cannot notify runxdg (pid=%d) (%s)", instance, strerror(errno));
+    metrics().counter("shared.send_errors")++;
+
+    // gone without releasing its slot, maybe in the middle of a write
+    if (errno == ECONNREFUSED) {
+      flock(m_shm_fd, LOCK_EX);
+      for (int i = 0; i < MAX_INSTANCES; ++i) {
+        if (m_shared->slots[i].instance.load() == instance) {
+          write_reset(m_shared->slots[i].seq);
+          release_slot(i);
+        }
+      }
+      flock(m_shm_fd, LOCK_UN);
+    }
+    return -1;
+  }
+
+  metrics().counter("shared.sent")++;
+  return 0;
+}
+
+bool SharedRegistry::trusted (const Event& event, const struct ucred& cred)
+{
+  if (cred.uid != getuid())
+    return false;
+
+  // only instances tell the broker about their app, all the rest comes
+  // from the broker
+  if (event.type == Event::EVENT_SLOT) {
+    if (!m_broker)
+      return false;
+    for (int i = 0; i < MAX_INSTANCES; ++i) {
+      if (m_shared->slots[i].instance.load() == cred.pid)
+        return true;
+    }
+    return false;
+  }
+
+  return cred.pid == m_shared->broker.load();
+}
+
+void SharedRegistry::receive (void)
+{
+  Event event;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(struct ucred))];
+  } control;
+
+  while (true) {
+    struct iovec iov = { &event, sizeof(event) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t len = recvmsg(m_sock, &msg, 0);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      return;  // EAGAIN
+    }
+    if (len != sizeof(event) || (msg.msg_flags & MSG_CTRUNC))
+      continue;
+
+    const struct ucred *cred = nullptr;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_CREDENTIALS)
+        cred = reinterpret_cast<const struct ucred*>(CMSG_DATA(cmsg));
+    }
+    if (!cred || !trusted(event, *cred)) {
+      AGL_WARN("drop event (type=%u) from pid %d", event.type,
+               cred ? cred->pid : 0);
+      metrics().counter("shared.rejected")++;
+      continue;
+    }
+    event.sender = cred->pid;  // not what the datagram claims
+
+    metrics().counter("shared.received")++;
+    if (m_on_event)
+      m_on_event(event);
+  }
+}
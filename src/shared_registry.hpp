@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef SHARED_REGISTRY_HPP
+#define SHARED_REGISTRY_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <ilm/ilm_control.h>
+
+#include "pid_namespace.hpp"
+
+struct ucred;
+class Reactor;
+
+/*
+ * Registry of surface ownership shared by the runxdg instances of a
+ * session, so that ILM events are not handled N times for N apps.
+ *
+ * Every instance publishes the pids of its app in a slot of a shared
+ * memory file. One instance, elected with flock(), is the broker: it is
+ * the only one subscribing to ILM notifications, resolves the creator of
+ * each surface once, publishes its owner and sends a datagram to the
+ * owning instance only. Taps of HomeScreen are routed the same way, by
+ * the role published in the slot. When the broker exits, a waiting
+ * instance takes over the published surfaces, reading them with a seqlock
+ * without any lock, and only resolves the ones it doesn't know.
+ */
+class SharedRegistry
+{
+  public:
+    struct Event {
+      enum Type {
+        EVENT_CREATED,    // broker -> owner, props are valid
+        EVENT_DESTROYED,  // broker -> owner
+        EVENT_SLOT,       // instance -> broker, its app pids changed
+        EVENT_TAP         // broker -> owner of the tapped role
+      };
+
+      uint32_t type;
+      pid_t sender;
+      t_ilm_surface id;
+      pid_t creator;
+      struct ilmSurfaceProperties props;
+    };
+
+    SharedRegistry(Reactor& reactor, const std::string& path,
+                   const std::string& role);
+    ~SharedRegistry(void);
+
+    int open(void);
+    bool broker(void) const { return m_broker; }
+
+    // Any instance: pids of its app, 0 when it is not running. If rid is
+    // its pid in a pid namespace of its own, since is boot_ticks() at
+    // launch, so that the broker can find it (see PidNamespace).
+    void publish_app(pid_t rid, pid_t local_rid, uint64_t since);
+
+    // broker only
+    pid_t find_owner(pid_t creator);  // instance pid, 0 if none
+    pid_t find_role(const std::string& role);
+    void publish_surface(t_ilm_surface id, pid_t creator, pid_t owner);
+    pid_t remove_surface(t_ilm_surface id);  // previous owner
+    pid_t published(t_ilm_surface id);  // owner, -1 if not published
+    // keeps the surfaces among ids, the <id, owner> of the others
+    std::vector<std::pair<t_ilm_surface, pid_t>>
+        retain_surfaces(const t_ilm_surface *ids, int count);
+    // surfaces without owner created by a process of instance
+    std::vector<t_ilm_surface> adoptable_surfaces(pid_t instance);
+    int send(pid_t instance, Event::Type type, t_ilm_surface id,
+             pid_t creator, const struct ilmSurfaceProperties *props);
+
+    std::function<void(void)> m_on_broker;  // in the reactor
+    std::function<void(const Event&)> m_on_event;
+
+  private:
+    struct Shared;
+
+    Reactor& m_reactor;
+    std::string m_path;
+    std::string m_role;
+    pid_t m_self;
+
+    Shared *m_shared = nullptr;
+    int m_shm_fd = -1;
+    int m_lock_fd = -1;
+    int m_sock = -1;
+    int m_slot = -1;
+    bool m_broker = false;
+
+    std::thread m_election;
+    std::shared_ptr<std::atomic<bool>> m_alive;
+
+    // broker: index of published surfaces in the shared table
+    std::unordered_map<t_ilm_surface, int> m_index;
+    std::vector<int> m_free;
+    PidNamespace m_pidns;  // creators of containerized apps
+
+    int map(void);
+    int claim_slot(void);
+    int bind_socket(void);
+    void elect(void);
+    void become_broker(void);
+    void load_surfaces(void);
+    void receive(void);
+    bool trusted(const Event& event, const struct ucred& cred);
+    void release_slot(int slot);
+};
+
+#endif  // SHARED_REGISTRY_HPP
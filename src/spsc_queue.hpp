@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <stddef.h>
+
+#include <atomic>
+
+/*
+ * Bounded lock-free queue for exactly one producer thread and one
+ * consumer thread. N must be a power of 2.
+ */
+template <typename T, size_t N>
+class SPSCQueue
+{
+    static_assert(N && !(N & (N - 1)), "N must be a power of 2");
+
+  public:
+    // producer side, false if the queue is full
+    bool push(const T& item) {
+      size_t tail = m_tail.load(std::memory_order_relaxed);
+      if (tail - m_head.load(std::memory_order_acquire) == N)
+        return false;
+
+      m_buf[tail & (N - 1)] = item;
+      m_tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    // consumer side, false if the queue is empty
+    bool pop(T& item) {
+      size_t head = m_head.load(std::memory_order_relaxed);
+      if (head == m_tail.load(std::memory_order_acquire))
+        return false;
+
+      item = m_buf[head & (N - 1)];
+      m_head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    size_t size(void) const {
+      return m_tail.load(std::memory_order_acquire) -
+             m_head.load(std::memory_order_acquire);
+    }
+
+    static constexpr size_t capacity(void) { return N; }
+
+  private:
+    // keep indexes on their own cache lines
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+    alignas(64) T m_buf[N];
+};
+
+#endif  // SPSC_QUEUE_HPP
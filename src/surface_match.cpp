@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <limits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include "runxdg.hpp"
+#include "metrics.hpp"
+#include "surface_match.hpp"
+
+// relative costs of conditions
+#define COST_SURFACE 0  // properties of the surface, already known
+#define COST_READLINK 1
+#define COST_READ 2
+#define COST_REGEX 3
+
+static std::string read_proc (pid_t pid, const char *name)
+{
+  std::string path = "/proc/" + std::to_string(pid) + "/" + name;
+  std::ifstream ifs(path);
+  return std::string(std::istreambuf_iterator<char>(ifs),
+                     std::istreambuf_iterator<char>());
+}
+
+const std::string& SurfaceMatcher::Facts::get_exe (void)
+{
+  if (!has_exe) {
+    char buf[PATH_MAX];
+    std::string path = "/proc/" + std::to_string(pid) + "/exe";
+    ssize_t len = readlink(path.c_str(), buf, sizeof(buf) - 1);
+    if (len > 0)
+      exe.assign(buf, len);
+    has_exe = true;
+  }
+  return exe;
+}
+
+const std::string& SurfaceMatcher::Facts::get_cmdline (void)
+{
+  if (!has_cmdline) {
+    cmdline = read_proc(pid, "cmdline");
+    std::replace(cmdline.begin(), cmdline.end(), '\0', ' ');
+    while (!cmdline.empty() && cmdline.back() == ' ')
+      cmdline.pop_back();
+    has_cmdline = true;
+  }
+  return cmdline;
+}
+
+const std::string& SurfaceMatcher::Facts::get_cgroup (void)
+{
+  if (!has_cgroup) {
+    cgroup = read_proc(pid, "cgroup");
+    has_cgroup = true;
+  }
+  return cgroup;
+}
+
+SurfaceMatcher::Action SurfaceMatcher::parse_action (const std::string& str)
+{
+  if (str == "ignore")
+    return ACTION_IGNORE;
+  if (str == "main")
+    return ACTION_MAIN;
+  if (str == "popup")
+    return ACTION_POPUP;
+  if (str == "overlay")
+    return ACTION_OVERLAY;
+
+  AGL_FATAL("Unknown action of [match]: %s", str.c_str());
+  return ACTION_NONE;
+}
+
+void SurfaceMatcher::add_rule (const RuleSpec& spec)
+{
+  m_rules.emplace_back();
+  Rule& rule = m_rules.back();
+
+  rule.name = spec.name.empty() ? "#" + std::to_string(m_rules.size())
+                                : spec.name;
+  rule.action = parse_action(spec.action);
+
+  if (spec.order > 0) {
+    unsigned int order = spec.order;
+    rule.conditions.emplace_back(COST_SURFACE,
+        [order](const Candidate& c, Facts& f) { return c.order == order; });
+  }
+
+  if (spec.min_width || spec.max_width || spec.min_height || spec.max_height) {
+    t_ilm_uint min_w = spec.min_width, min_h = spec.min_height;
+    t_ilm_uint max_w = spec.max_width ? spec.max_width : UINT_MAX;
+    t_ilm_uint max_h = spec.max_height ? spec.max_height : UINT_MAX;
+    rule.conditions.emplace_back(COST_SURFACE,
+        [=](const Candidate& c, Facts& f) {
+      t_ilm_uint w = c.props->origSourceWidth;
+      t_ilm_uint h = c.props->origSourceHeight;
+      return w >= min_w && w <= max_w && h >= min_h && h <= max_h;
+    });
+  }
+
+  // Rules see every surface of the system. Without ancestry, they're
+  // limited to the app unless surfaces of other processes are asked for,
+  // picked by their creator then, not to claim anything.
+  if (spec.foreign) {
+    if (spec.exe.empty() && spec.cmdline.empty() && spec.cgroup.empty()) {
+      AGL_FATAL("foreign rule of [match] %s needs exe, cmdline or cgroup",
+                rule.name.c_str());
+    }
+  } else if (spec.ancestry.empty()) {
+    rule.conditions.emplace_back(COST_SURFACE,
+        [](const Candidate& c, Facts& f) {
+      return c.relation != RELATION_FOREIGN;
+    });
+  }
+
+  if (!spec.ancestry.empty()) {
+    bool self = spec.ancestry == "self" || spec.ancestry == "app";
+    bool descendant = spec.ancestry == "descendant" || spec.ancestry == "app";
+    if (!self && !descendant) {
+      AGL_FATAL("Unknown ancestry of [match]: %s", spec.ancestry.c_str());
+    }
+    rule.conditions.emplace_back(COST_SURFACE,
+        [self, descendant](const Candidate& c, Facts& f) {
+      return (self && c.relation == RELATION_SELF) ||
+             (descendant && c.relation == RELATION_DESCENDANT);
+    });
+  }
+
+  if (!spec.exe.empty()) {
+    std::string exe = spec.exe;
+    rule.conditions.emplace_back(COST_READLINK,
+        [exe](const Candidate& c, Facts& f) { return f.get_exe() == exe; });
+  }
+
+  if (!spec.cgroup.empty()) {
+    std::string cgroup = spec.cgroup;
+    rule.conditions.emplace_back(COST_READ,
+        [cgroup](const Candidate& c, Facts& f) {
+      return f.get_cgroup().find(cgroup) != std::string::npos;
+    });
+  }
+
+  if (!spec.cmdline.empty()) {
+    std::shared_ptr<std::regex> re;
+    try {
+      re = std::make_shared<std::regex>(spec.cmdline, std::regex::optimize);
+    } catch (const std::regex_error& e) {
+      AGL_FATAL("Invalid cmdline regex of [match] %s: %s",
+                rule.name.c_str(), e.what());
+    }
+    rule.conditions.emplace_back(COST_REGEX,
+        [re](const Candidate& c, Facts& f) {
+      return std::regex_search(f.get_cmdline(), *re);
+    });
+  }
+
+  std::stable_sort(rule.conditions.begin(), rule.conditions.end(),
+                   [](const std::pair<int, Condition>& a,
+                      const std::pair<int, Condition>& b) {
+    return a.first < b.first;
+  });
+
+  AGL_DEBUG("[match] rule %s: %zu condition(s)", rule.name.c_str(),
+            rule.conditions.size());
+}
+
+SurfaceMatcher::Action SurfaceMatcher::match (const Candidate& candidate)
+{
+  Facts facts;
+  facts.pid = candidate.pid;
+
+  for (const Rule& rule : m_rules) {
+    bool matched = true;
+    for (const auto& condition : rule.conditions) {
+      if (!condition.second(candidate, facts)) {
+        matched = false;
+        break;
+      }
+    }
+
+    if (matched) {
+      AGL_DEBUG("surface %d (pid=%d) matches rule %s", candidate.id,
+                candidate.pid, rule.name.c_str());
+      metrics().counter("match." + rule.name)++;
+      return rule.action;
+    }
+  }
+
+  return ACTION_NONE;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef SURFACE_MATCH_HPP
+#define SURFACE_MATCH_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include <ilm/ilm_control.h>
+
+/*
+ * Rules of the [match] section, deciding which surfaces belong to the app
+ * and their kind. Rules are compiled at config load: regexes are built
+ * once, and the conditions of each rule are sorted so that the cheap ones
+ * (order, dimensions, ancestry) reject a surface before /proc is read.
+ * The first matching rule wins.
+ */
+class SurfaceMatcher
+{
+  public:
+    enum Action {
+      ACTION_NONE,     // no rule matched, default attribution
+      ACTION_IGNORE,
+      ACTION_MAIN,
+      ACTION_POPUP,
+      ACTION_OVERLAY
+    };
+
+    enum Relation {
+      RELATION_FOREIGN,
+      RELATION_SELF,        // the app process itself
+      RELATION_DESCENDANT
+    };
+
+    // as written in runxdg.toml, empty/0 means "don't care"
+    struct RuleSpec {
+      std::string name;
+      std::string action;
+      std::string exe;        // exact path of /proc/<pid>/exe
+      std::string cmdline;    // regex, arguments joined with spaces
+      std::string ancestry;   // "self", "descendant" or "app" (both)
+      std::string cgroup;     // substring of /proc/<pid>/cgroup
+      int64_t min_width = 0;
+      int64_t max_width = 0;
+      int64_t min_height = 0;
+      int64_t max_height = 0;
+      int64_t order = 0;      // nth surface of the app since the launch
+      bool foreign = false;   // may claim surfaces of other processes
+    };
+
+    // what is known about a new surface without reading /proc
+    struct Candidate {
+      t_ilm_surface id;
+      pid_t pid;
+      const struct ilmSurfaceProperties *props;
+      Relation relation;
+      unsigned int order;
+    };
+
+    void add_rule(const RuleSpec& spec);  // AGL_FATAL on error
+    bool empty(void) const { return m_rules.empty(); }
+
+    Action match(const Candidate& candidate);
+
+  private:
+    // facts of the creator, read from /proc at most once per match()
+    struct Facts {
+      pid_t pid;
+      bool has_exe = false;
+      bool has_cmdline = false;
+      bool has_cgroup = false;
+      std::string exe;
+      std::string cmdline;
+      std::string cgroup;
+
+      const std::string& get_exe(void);
+      const std::string& get_cmdline(void);
+      const std::string& get_cgroup(void);
+    };
+
+    typedef std::function<bool(const Candidate&, Facts&)> Condition;
+
+    struct Rule {
+      std::string name;
+      Action action;
+      std::vector<std::pair<int, Condition>> conditions;  // <cost, cond>
+    };
+
+    std::vector<Rule> m_rules;
+
+    static Action parse_action(const std::string& str);
+};
+
+#endif  // SURFACE_MATCH_HPP
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "surface_registry.hpp"
+
+// popups and subprocesses may create a few hundreds of surfaces
+#define INITIAL_BUCKETS 256
+
+SurfaceRegistry::SurfaceRegistry (void)
+{
+  m_by_id.reserve(INITIAL_BUCKETS);
+  m_by_pid.reserve(INITIAL_BUCKETS);
+  m_by_pgid.reserve(INITIAL_BUCKETS);
+}
+
+size_t SurfaceRegistry::insert (Index& index, pid_t key, t_ilm_surface id)
+{
+  std::vector<t_ilm_surface>& ids = index[key];
+  ids.push_back(id);
+  return ids.size() - 1;
+}
+
+void SurfaceRegistry::erase (Index& index, pid_t key, size_t slot,
+                             bool by_pid)
+{
+  auto itr = index.find(key);
+  if (itr == index.end())
+    return;
+
+  std::vector<t_ilm_surface>& ids = itr->second;
+  if (slot != ids.size() - 1) {
+    // move the last one into the hole, and fix its slot
+    t_ilm_surface moved = ids.back();
+    ids[slot] = moved;
+    Entry& entry = m_by_id[moved];
+    if (by_pid)
+      entry.pid_slot = slot;
+    else
+      entry.pgid_slot = slot;
+  }
+  ids.pop_back();
+
+  if (ids.empty())
+    index.erase(itr);
+}
+
+void SurfaceRegistry::add (t_ilm_surface id,
+                           const struct ilmSurfaceProperties& props,
+                           pid_t pgid)
+{
+  pid_t pid = props.creatorPid;
+
+  // a recycled id replaces the stale entry
+  remove(id);
+
+  Entry entry;
+  entry.surface.id = id;
+  entry.surface.pid = pid;
+  entry.surface.pgid = pgid;
+  entry.surface.props = props;
+  entry.pid_slot = insert(m_by_pid, pid, id);
+  entry.pgid_slot = insert(m_by_pgid, pgid, id);
+  m_by_id[id] = entry;
+}
+
+bool SurfaceRegistry::remove (t_ilm_surface id, Surface *surface)
+{
+  auto itr = m_by_id.find(id);
+  if (itr == m_by_id.end())
+    return false;
+
+  Entry entry = itr->second;
+  m_by_id.erase(itr);
+
+  erase(m_by_pid, entry.surface.pid, entry.pid_slot, true);
+  erase(m_by_pgid, entry.surface.pgid, entry.pgid_slot, false);
+
+  if (surface)
+    *surface = entry.surface;
+  return true;
+}
+
+void SurfaceRegistry::clear (void)
+{
+  m_by_id.clear();
+  m_by_pid.clear();
+  m_by_pgid.clear();
+}
+
+const SurfaceRegistry::Surface* SurfaceRegistry::find (t_ilm_surface id) const
+{
+  auto itr = m_by_id.find(id);
+  if (itr == m_by_id.end())
+    return nullptr;
+  return &itr->second.surface;
+}
+
+t_ilm_surface SurfaceRegistry::find_by_pid (pid_t pid) const
+{
+  auto itr = m_by_pid.find(pid);
+  if (itr == m_by_pid.end())
+    return 0;
+  return itr->second.front();
+}
+
+t_ilm_surface SurfaceRegistry::find_by_pgid (pid_t pgid) const
+{
+  auto itr = m_by_pgid.find(pgid);
+  if (itr == m_by_pgid.end())
+    return 0;
+  return itr->second.front();
+}
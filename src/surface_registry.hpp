@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2017 Panasonic Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef SURFACE_REGISTRY_HPP
+#define SURFACE_REGISTRY_HPP
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include <ilm/ilm_control.h>
+
+/*
+ * IVI surfaces known to runxdg, indexed by surface id, creator pid and
+ * creator process group. Every index is a hash map and a removal swaps
+ * the last entry of a bucket into the hole, so add() and remove() are
+ * O(1) whatever the number of surfaces.
+ *
+ * The maps are node-based std::unordered_map, with a vector of surfaces
+ * per pid and per pgid, not flat open-addressing maps: no dependency is
+ * added for a few hundred surfaces at most, at the cost of a node
+ * allocation per add().
+ */
+class SurfaceRegistry
+{
+  public:
+    struct Surface {
+      t_ilm_surface id;
+      pid_t pid;    // creator
+      pid_t pgid;
+      struct ilmSurfaceProperties props;  // as of the creation
+    };
+
+    SurfaceRegistry(void);
+
+    void add(t_ilm_surface id, const struct ilmSurfaceProperties& props,
+             pid_t pgid);
+    // false if unknown, the removed surface is copied to *surface
+    bool remove(t_ilm_surface id, Surface *surface = nullptr);
+    void clear(void);
+
+    const Surface* find(t_ilm_surface id) const;
+    // any surface created by pid / by a process of pgid, 0 if none
+    t_ilm_surface find_by_pid(pid_t pid) const;
+    t_ilm_surface find_by_pgid(pid_t pgid) const;
+
+    size_t size(void) const { return m_by_id.size(); }
+
+  private:
+    struct Entry {
+      Surface surface;
+      size_t pid_slot;   // position in m_by_pid[pid]
+      size_t pgid_slot;  // position in m_by_pgid[pgid]
+    };
+
+    typedef std::unordered_map<pid_t, std::vector<t_ilm_surface>> Index;
+
+    std::unordered_map<t_ilm_surface, Entry> m_by_id;
+    Index m_by_pid;
+    Index m_by_pgid;
+
+    size_t insert(Index& index, pid_t key, t_ilm_surface id);
+    void erase(Index& index, pid_t key, size_t slot, bool by_pid);
+};
+
+#endif  // SURFACE_REGISTRY_HPP